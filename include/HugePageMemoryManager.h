@@ -0,0 +1,376 @@
+//===- HugePageMemoryManager.h - Code memory packed into huge pages -*- C++ -*-===//
+//
+// Contains a RuntimeDyld memory manager that places code sections of all JIT'd
+// objects into a few large, contiguous, huge-page backed regions instead of a
+// separate mapping per object, to keep the iTLB footprint of many small
+// functions low.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_HUGEPAGEMEMORYMANAGER_H
+#define KALEIDOSCOPE_HUGEPAGEMEMORYMANAGER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/TargetParser/Triple.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#if defined(__APPLE__) && defined(__aarch64__)
+#include <pthread.h>
+#endif
+
+namespace llvm {
+    namespace orc {
+
+        enum class HugePageMode {
+            None,        // one SectionMemoryManager mapping per object
+            Transparent, // 2 MiB aligned regions with madvise(MADV_HUGEPAGE)
+            Explicit     // MAP_HUGETLB regions, falling back to transparent
+        };
+
+        // Code placed in this section is allocated from the hot arena, so the
+        // hottest functions end up next to each other.
+        inline const char *getHotSectionName(const Triple &TT) {
+            return TT.isOSBinFormatMachO() ? "__TEXT,__text_hot,regular,pure_instructions" : ".text.hot";
+        }
+
+        inline bool isHotSection(StringRef SectionName) {
+            return SectionName == ".text.hot" || SectionName == "__text_hot";
+        }
+
+        // CodeArena - hands out code memory from large regions whose
+        // permissions are set once, so per-object permission changes never split
+        // the huge pages backing them. On Linux a region is a memfd mapped twice:
+        // code runs from a read/execute view and is written through a separate
+        // read/write alias, so no page is writable and executable at once. On
+        // macOS it is one MAP_JIT mapping. Freed blocks are coalesced and reused
+        // lowest address first, which keeps live code packed.
+        class CodeArena {
+        public:
+            static constexpr size_t RegionSize = 2 * 1024 * 1024;
+
+            explicit CodeArena(HugePageMode Mode) : Mode(Mode) {
+#ifdef __linux__
+                registerForFork(this);
+#endif
+            }
+
+            CodeArena(const CodeArena &) = delete;
+            CodeArena &operator=(const CodeArena &) = delete;
+
+            ~CodeArena() {
+#ifdef __linux__
+                unregisterForFork(this);
+#endif
+#ifndef _WIN32
+                for (auto &R: Regions) {
+                    munmap(R.Addr, R.Size);
+                    if (R.Writable != R.Addr)
+                        munmap(R.Writable, R.Size);
+                }
+#endif
+            }
+
+            // Returns the address the code runs at, nullptr if no region could
+            // be mapped.
+            uint8_t *allocate(uintptr_t Size, unsigned Alignment) {
+                std::lock_guard<std::mutex> Lock(M);
+                if (Forked)
+                    return nullptr;
+                if (uint8_t *Addr = allocateFromFreeList(Size, Alignment))
+                    return Addr;
+                size_t Bytes = alignTo(Size + Alignment, RegionSize);
+                Region R = mapRegion(Bytes);
+                if (!R.Addr)
+                    return nullptr;
+                Regions.push_back(R);
+                Free[R.Addr] = Bytes;
+                return allocateFromFreeList(Size, Alignment);
+            }
+
+            // Where the linker writes the code that runs at Addr.
+            uint8_t *getWritableAddress(uint8_t *Addr) {
+                std::lock_guard<std::mutex> Lock(M);
+                for (auto &R: Regions)
+                    if (Addr >= R.Addr && Addr < R.Addr + R.Size)
+                        return R.Writable + (Addr - R.Addr);
+                return Addr;
+            }
+
+            void release(uint8_t *Addr, uintptr_t Size) {
+                std::lock_guard<std::mutex> Lock(M);
+                auto I = Free.emplace(Addr, Size).first;
+                auto Next = std::next(I);
+                if (Next != Free.end() && I->first + I->second == Next->first) {
+                    I->second += Next->second;
+                    Free.erase(Next);
+                }
+                if (I != Free.begin()) {
+                    auto Prev = std::prev(I);
+                    if (Prev->first + Prev->second == I->first) {
+                        Prev->second += I->second;
+                        Free.erase(I);
+                    }
+                }
+            }
+
+        private:
+            struct Region {
+                uint8_t *Addr = nullptr;     // the view code runs from
+                uint8_t *Writable = nullptr; // the same memory, writable
+                size_t Size = 0;
+                uint8_t *ForkCopy = nullptr; // private copy while forking
+            };
+
+            HugePageMode Mode;
+            std::mutex M;
+            std::vector<Region> Regions;
+            std::map<uint8_t *, size_t> Free; // start -> size
+            bool Forked = false;
+
+            uint8_t *allocateFromFreeList(uintptr_t Size, unsigned Alignment) {
+                for (auto I = Free.begin(); I != Free.end(); ++I) {
+                    uintptr_t Block = reinterpret_cast<uintptr_t>(I->first);
+                    uintptr_t End = Block + I->second;
+                    uintptr_t Start = alignTo(Block, Alignment);
+                    if (Start + Size > End)
+                        continue;
+                    Free.erase(I);
+                    if (Start > Block)
+                        Free[reinterpret_cast<uint8_t *>(Block)] = Start - Block;
+                    if (Start + Size < End)
+                        Free[reinterpret_cast<uint8_t *>(Start + Size)] = End - (Start + Size);
+                    return reinterpret_cast<uint8_t *>(Start);
+                }
+                return nullptr;
+            }
+
+            Region mapRegion(size_t Bytes) {
+#if defined(_WIN32)
+                return {};
+#elif defined(__APPLE__)
+                // No user-visible superpages on Apple Silicon; a single MAP_JIT
+                // region still keeps code contiguous and avoids W^X mprotect churn.
+                // On arm64 it is only writable between allocateCodeSection and
+                // finalizeMemory, see pthread_jit_write_protect_np.
+                int Flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_JIT
+                Flags |= MAP_JIT;
+#endif
+                void *P = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE | PROT_EXEC, Flags, -1, 0);
+                if (P == MAP_FAILED)
+                    return {};
+                return {static_cast<uint8_t *>(P), static_cast<uint8_t *>(P), Bytes};
+#elif defined(__linux__)
+#ifdef MFD_HUGETLB
+                if (Mode == HugePageMode::Explicit) {
+                    int Fd = memfd_create("kaleidoscope-code", MFD_CLOEXEC | MFD_HUGETLB);
+                    if (Fd >= 0) {
+                        Region R = mapViews(Fd, Bytes);
+                        if (R.Addr)
+                            return R;
+                    }
+                    // no reserved huge pages, try transparent ones instead
+                }
+#endif
+                int Fd = memfd_create("kaleidoscope-code", MFD_CLOEXEC);
+                if (Fd < 0)
+                    return {};
+                Region R = mapViews(Fd, Bytes);
+#ifdef MADV_HUGEPAGE
+                // shared memory only gets transparent huge pages when
+                // /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it
+                if (R.Addr)
+                    madvise(R.Addr, Bytes, MADV_HUGEPAGE);
+#endif
+                return R;
+#else
+                // no way to alias the memory here: leave the code to
+                // SectionMemoryManager rather than map it writable and executable
+                return {};
+#endif
+            }
+
+#ifdef __linux__
+            // mapViews - map Fd read/execute on a 2 MiB boundary and read/write
+            // anywhere; closes Fd
+            static Region mapViews(int Fd, size_t Bytes) {
+                Region R;
+                // over-reserve so the executable view can start on a 2 MiB boundary
+                void *P = MAP_FAILED;
+                if (ftruncate(Fd, Bytes) == 0)
+                    P = mmap(nullptr, Bytes + RegionSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (P != MAP_FAILED) {
+                    uintptr_t Raw = reinterpret_cast<uintptr_t>(P);
+                    uintptr_t Start = alignTo(Raw, RegionSize);
+                    if (Start > Raw)
+                        munmap(P, Start - Raw);
+                    munmap(reinterpret_cast<void *>(Start + Bytes), Raw + RegionSize - Start);
+                    void *Exec = mmap(reinterpret_cast<void *>(Start), Bytes, PROT_READ | PROT_EXEC,
+                                      MAP_SHARED | MAP_FIXED, Fd, 0);
+                    void *Write = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+                    if (Exec != MAP_FAILED && Write != MAP_FAILED) {
+                        R = {static_cast<uint8_t *>(Exec), static_cast<uint8_t *>(Write), Bytes};
+                    } else {
+                        munmap(reinterpret_cast<void *>(Start), Bytes);
+                        if (Write != MAP_FAILED)
+                            munmap(Write, Bytes);
+                    }
+                }
+                close(Fd);
+                return R;
+            }
+
+            // The views are shared mappings, so a forked worker would see the
+            // code the session later writes over freed blocks it may still be
+            // running. The regions are copied before the fork, as the parent
+            // may write as soon as it returns; the child runs from the copies
+            // and stops allocating.
+            static std::mutex &getForkMutex() {
+                static std::mutex ForkMutex;
+                return ForkMutex;
+            }
+
+            static std::vector<CodeArena *> &getArenas() {
+                static std::vector<CodeArena *> Arenas;
+                return Arenas;
+            }
+
+            static void registerForFork(CodeArena *Arena) {
+                static std::once_flag Registered;
+                std::call_once(Registered, []() { pthread_atfork(prepareFork, afterForkInParent, afterForkInChild); });
+                std::lock_guard<std::mutex> Lock(getForkMutex());
+                getArenas().push_back(Arena);
+            }
+
+            static void unregisterForFork(CodeArena *Arena) {
+                std::lock_guard<std::mutex> Lock(getForkMutex());
+                auto &Arenas = getArenas();
+                Arenas.erase(std::remove(Arenas.begin(), Arenas.end(), Arena), Arenas.end());
+            }
+
+            static void prepareFork() {
+                getForkMutex().lock();
+                for (CodeArena *Arena: getArenas()) {
+                    Arena->M.lock();
+                    for (auto &R: Arena->Regions) {
+                        void *Copy = mmap(nullptr, R.Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                        if (Copy == MAP_FAILED)
+                            continue;
+                        memcpy(Copy, R.Addr, R.Size);
+                        mprotect(Copy, R.Size, PROT_READ | PROT_EXEC);
+                        R.ForkCopy = static_cast<uint8_t *>(Copy);
+                    }
+                }
+            }
+
+            static void afterForkInParent() {
+                for (CodeArena *Arena: getArenas()) {
+                    for (auto &R: Arena->Regions) {
+                        if (R.ForkCopy)
+                            munmap(R.ForkCopy, R.Size);
+                        R.ForkCopy = nullptr;
+                    }
+                    Arena->M.unlock();
+                }
+                getForkMutex().unlock();
+            }
+
+            static void afterForkInChild() {
+                for (CodeArena *Arena: getArenas()) {
+                    Arena->Forked = true;
+                    for (auto &R: Arena->Regions) {
+                        if (R.ForkCopy && mremap(R.ForkCopy, R.Size, R.Size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                                                 R.Addr) != MAP_FAILED) {
+                            munmap(R.Writable, R.Size);
+                            R.Writable = R.Addr;
+                        }
+                        R.ForkCopy = nullptr;
+                    }
+                    Arena->M.unlock();
+                }
+                getForkMutex().unlock();
+            }
+#endif
+        };
+
+        // HugePageMemoryManager - one per JIT'd object, like SectionMemoryManager.
+        // Code sections come from the shared hot or general arena; data sections
+        // are left to SectionMemoryManager.
+        class HugePageMemoryManager : public SectionMemoryManager {
+        public:
+            HugePageMemoryManager(std::shared_ptr<CodeArena> HotArena,
+                                  std::shared_ptr<CodeArena> Arena)
+                    : HotArena(std::move(HotArena)), Arena(std::move(Arena)) {}
+
+            ~HugePageMemoryManager() override {
+                for (auto &B: Blocks)
+                    B.Owner->release(B.Addr, B.Size);
+            }
+
+            uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                         unsigned SectionID, StringRef SectionName) override {
+                auto &Owner = isHotSection(SectionName) ? HotArena : Arena;
+                uintptr_t Bytes = alignTo(std::max<uintptr_t>(Size, 1), 16);
+                if (uint8_t *Addr = Owner->allocate(Bytes, std::max(Alignment, 16u))) {
+#if defined(__APPLE__) && defined(__aarch64__)
+                    // MAP_JIT pages are writable for this thread until finalizeMemory
+                    pthread_jit_write_protect_np(0);
+#endif
+                    uint8_t *Writable = Owner->getWritableAddress(Addr);
+                    Blocks.push_back({Owner.get(), Addr, Writable, Bytes});
+                    return Writable;
+                }
+                return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID,
+                                                                 SectionName);
+            }
+
+            using SectionMemoryManager::notifyObjectLoaded;
+
+            // The linker wrote the code through the writable alias; relocate it
+            // for the address it runs at.
+            void notifyObjectLoaded(RuntimeDyld &RTDyld, const object::ObjectFile &) override {
+                for (auto &B: Blocks)
+                    if (B.Writable != B.Addr)
+                        RTDyld.mapSectionAddress(B.Writable, pointerToJITTargetAddress(B.Addr));
+            }
+
+            bool finalizeMemory(std::string *ErrMsg = nullptr) override {
+#if defined(__APPLE__) && defined(__aarch64__)
+                if (!Blocks.empty())
+                    pthread_jit_write_protect_np(1);
+#endif
+                for (auto &B: Blocks)
+                    sys::Memory::InvalidateInstructionCache(B.Addr, B.Size);
+                return SectionMemoryManager::finalizeMemory(ErrMsg);
+            }
+
+        private:
+            struct Block {
+                CodeArena *Owner;
+                uint8_t *Addr;     // where the code runs
+                uint8_t *Writable; // where the linker writes it
+                uintptr_t Size;
+            };
+
+            std::shared_ptr<CodeArena> HotArena, Arena;
+            std::vector<Block> Blocks;
+        };
+
+    } // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_HUGEPAGEMEMORYMANAGER_H
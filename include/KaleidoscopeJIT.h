@@ -17,44 +17,527 @@
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Transforms/IPO/HotColdSplitting.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <thread>
+#include <vector>
+#include "HugePageMemoryManager.h"
+#include "TieredIRCompiler.h"
 
 namespace llvm {
     namespace orc {
 
+        static void handleLazyCallThroughError() {
+            errs() << "LazyCallThrough error: Could not find function body";
+            exit(1);
+        }
+
+        // BoundedTaskDispatcher - like DynamicThreadPoolTaskDispatcher, a thread
+        // per task, but at most MaxMaterializations materializations run at
+        // once; the rest wait in a queue for a materialization thread to take
+        // them. Other tasks, which a materialization may be waiting for, are
+        // never queued.
+        class BoundedTaskDispatcher : public TaskDispatcher {
+        public:
+            explicit BoundedTaskDispatcher(size_t MaxMaterializations)
+                    : MaxMaterializations(MaxMaterializations) {}
+
+            void dispatch(std::unique_ptr<Task> T) override {
+                bool Materialization = isa<MaterializationTask>(*T);
+                std::lock_guard<std::mutex> Lock(M);
+                if (Materialization) {
+                    if (Materializing == MaxMaterializations) {
+                        Queued.push_back(std::move(T));
+                        return;
+                    }
+                    ++Materializing;
+                }
+                ++Outstanding;
+                std::thread([this, Materialization, T = std::move(T)]() mutable {
+                    while (true) {
+                        T->run();
+                        T.reset();
+                        std::lock_guard<std::mutex> Lock(M);
+                        if (Materialization && !Queued.empty()) {
+                            T = std::move(Queued.front());
+                            Queued.pop_front();
+                            continue;
+                        }
+                        if (Materialization)
+                            --Materializing;
+                        if (--Outstanding == 0)
+                            OutstandingCV.notify_all();
+                        return;
+                    }
+                }).detach();
+            }
+
+            void shutdown() override {
+                std::unique_lock<std::mutex> Lock(M);
+                OutstandingCV.wait(Lock, [this]() { return Outstanding == 0; });
+            }
+
+        private:
+            size_t MaxMaterializations;
+            std::mutex M;
+            std::condition_variable OutstandingCV;
+            size_t Outstanding = 0;
+            size_t Materializing = 0;
+            std::deque<std::unique_ptr<Task>> Queued;
+        };
+
         class KaleidoscopeJIT {
         private:
+            // A named definition. Its machine code lives in ImplJD under its own
+            // ResourceTracker and is reached through a stub in MainJD, so the code
+            // can be evicted and recompiled from the retained IR without moving
+            // the address callers were linked against.
+            struct FunctionBody {
+                ThreadSafeModule IR;    // pristine copy used for recompilation
+                ResourceTrackerSP RT;
+                uint64_t CodeSize = 0;  // bytes of loaded sections, 0 if not resident
+                uint64_t Calls = 0;     // bumped by the body's entry block
+                uint64_t EarlierCalls = 0; // calls to the bodies it replaced
+                uint64_t CallsAtLastSweep = 0;
+                uint64_t LastUsed = 0;  // sweep epoch of the most recent call
+                bool Hot = false;       // recompiled with its profile
+                // taken/not-taken counts of each instrumented branch, see addFunction
+                std::unique_ptr<uint64_t[]> BranchCounts;
+                unsigned NumBranchCounts = 0;
+                // direct callees and their number of call sites, for speculation
+                std::vector<std::pair<uint64_t, std::string>> Callees;
+            };
+
             std::unique_ptr<ExecutionSession> ES;
+            std::unique_ptr<EPCIndirectionUtils> EPCIU;
 
             DataLayout DL;
             MangleAndInterner Mangle;
+            std::string HotSection;
+
+            HugePageMode HugePages = HugePageMode::None;
+            std::shared_ptr<CodeArena> HotArena, Arena;
 
             RTDyldObjectLinkingLayer ObjectLayer;
             IRCompileLayer CompileLayer;
 
             JITDylib &MainJD;
+            JITDylib &ImplJD;
+            // Process symbols, and the prelude: definitions compiled once and
+            // shared read-only by every dylib of the session. The prelude only
+            // sees the runtime, never session code.
+            JITDylib &RuntimeJD;
+            JITDylib *PreludeJD = nullptr;
+            std::vector<JITDylib *> LibraryJDs; // imported libraries, in order
+            std::set<JITDylib *> TenantJDs;
+
+            std::unique_ptr<IndirectStubsManager> ISM;
+            // keyed by unmangled name; std::map keeps the Calls counters in place
+            std::map<std::string, FunctionBody> Bodies;
+            std::map<SymbolStringPtr, FunctionBody *> BodiesByImplSymbol;
+            // names whose stub points at the stub of another definition
+            std::map<std::string, std::string> AliasTargets;
+            uint64_t CodeBudget = 0; // 0 means unlimited
+            bool RetainIR = true;    // without retained IR bodies cannot be evicted
+            bool ProfileBranches = false;
+            // definitions start in the fast codegen tier until they are recompiled hot
+            bool FastDefinitions = false;
+            std::function<void(Function &)> HotOptimizer;
+            uint64_t ResidentCodeSize = 0;
+            uint64_t SweepEpoch = 0;
+            // guards the bookkeeping above against notifyLoaded running on a
+            // speculation thread
+            std::recursive_mutex StateMutex;
+
+            // Speculative compilation: callees of freshly compiled code are
+            // compiled on background threads, most call sites first, so that
+            // their first call finds them ready.
+            std::vector<std::thread> SpeculationThreads;
+            std::mutex SpeculationMutex;
+            std::condition_variable SpeculationCV, SpeculationIdleCV;
+            std::priority_queue<std::pair<uint64_t, std::string>> SpeculationQueue;
+            std::set<std::string> Speculating; // queued or in flight
+            unsigned SpeculationInFlight = 0;
+            bool StopSpeculation = false;
+            // callees of compiled code that were not defined yet, by call sites
+            std::map<std::string, uint64_t> WantedCallees;
+            // callees of anonymous expressions, until those are compiled
+            std::map<SymbolStringPtr, std::vector<std::pair<uint64_t, std::string>>> PendingCallees;
+
+            TieredIRCompiler &getTieredCompiler() {
+                return static_cast<TieredIRCompiler &>(CompileLayer.getCompiler());
+            }
+
+            static std::string getImplName(StringRef Name) { return (Name + "$impl").str(); }
+
+            static std::string getCounterName(StringRef Name) { return ("__ks_calls." + Name).str(); }
+
+            static std::string getBranchCounterName(StringRef Name) { return ("__ks_branches." + Name).str(); }
+
+            // Direct callees of the functions defined in M, by number of call sites
+            static std::vector<std::pair<uint64_t, std::string>> collectCallees(Module &M) {
+                std::map<std::string, uint64_t> Sites;
+                for (auto &F: M)
+                    for (auto &BB: F)
+                        for (auto &I: BB)
+                            if (auto *CB = dyn_cast<CallBase>(&I))
+                                if (Function *Callee = CB->getCalledFunction())
+                                    if (Callee->isDeclaration() && !Callee->isIntrinsic())
+                                        ++Sites[Callee->getName().str()];
+                std::vector<std::pair<uint64_t, std::string>> Callees;
+                for (auto &[Name, Count]: Sites)
+                    Callees.emplace_back(Count, Name);
+                return Callees;
+            }
+
+            // Queue the callees that have a body which is not compiled yet.
+            // Called with StateMutex held.
+            void speculate(const std::vector<std::pair<uint64_t, std::string>> &Callees) {
+                if (SpeculationThreads.empty())
+                    return;
+                if (CodeBudget && ResidentCodeSize >= CodeBudget)
+                    return;
+                std::lock_guard<std::mutex> Lock(SpeculationMutex);
+                for (auto &[Sites, Name]: Callees) {
+                    auto I = Bodies.find(Name);
+                    if (I == Bodies.end()) {
+                        WantedCallees[Name] += Sites;
+                        continue;
+                    }
+                    if (I->second.CodeSize || !Speculating.insert(Name).second)
+                        continue;
+                    SpeculationQueue.emplace(Sites, Name);
+                }
+                SpeculationCV.notify_all();
+            }
+
+            void runSpeculation() {
+                while (true) {
+                    std::string Name;
+                    {
+                        std::unique_lock<std::mutex> Lock(SpeculationMutex);
+                        SpeculationCV.wait(Lock, [this]() {
+                            return StopSpeculation || !SpeculationQueue.empty();
+                        });
+                        if (StopSpeculation)
+                            return;
+                        Name = SpeculationQueue.top().second;
+                        SpeculationQueue.pop();
+                        ++SpeculationInFlight;
+                    }
+                    // A wrong guess is harmless: a real call reports any error again.
+                    consumeError(compileNow(Name));
+                    {
+                        std::lock_guard<std::mutex> Lock(SpeculationMutex);
+                        --SpeculationInFlight;
+                        Speculating.erase(Name);
+                    }
+                    SpeculationIdleCV.notify_all();
+                }
+            }
+
+            // Drop queued speculation and wait for the compiles in flight, before
+            // code is evicted or recompiled.
+            void pauseSpeculation() {
+                std::unique_lock<std::mutex> Lock(SpeculationMutex);
+                while (!SpeculationQueue.empty()) {
+                    Speculating.erase(SpeculationQueue.top().second);
+                    SpeculationQueue.pop();
+                }
+                SpeculationIdleCV.wait(Lock, [this]() { return SpeculationInFlight == 0; });
+            }
+
+            // Count both directions of every two-way branch whose successors have
+            // no other predecessor, i.e. the arms of an if/then/else. Each such
+            // branch is tagged with !ks.prof holding its index into the counters.
+            static unsigned instrumentBranches(Function &F, StringRef Name) {
+                Module &M = *F.getParent();
+                auto *Int64Ty = Type::getInt64Ty(M.getContext());
+                std::vector<BranchInst *> Branches;
+                for (auto &BB: F)
+                    if (auto *BI = dyn_cast<BranchInst>(BB.getTerminator()))
+                        if (BI->isConditional() && BI->getSuccessor(0)->getSinglePredecessor() &&
+                            BI->getSuccessor(1)->getSinglePredecessor())
+                            Branches.push_back(BI);
+                if (Branches.empty())
+                    return 0;
+
+                auto *CountsTy = ArrayType::get(Int64Ty, 2 * Branches.size());
+                auto *Counts = M.getOrInsertGlobal(getBranchCounterName(Name), CountsTy);
+                for (unsigned K = 0; K != Branches.size(); ++K) {
+                    BranchInst *BI = Branches[K];
+                    BI->setMetadata("ks.prof", MDNode::get(M.getContext(), ConstantAsMetadata::get(
+                            ConstantInt::get(Int64Ty, K))));
+                    for (unsigned Succ = 0; Succ != 2; ++Succ) {
+                        IRBuilder<> Builder(&*BI->getSuccessor(Succ)->getFirstInsertionPt());
+                        Value *Slot = Builder.CreateConstInBoundsGEP2_64(CountsTy, Counts, 0, 2 * K + Succ);
+                        Value *N = Builder.CreateLoad(Int64Ty, Slot);
+                        Builder.CreateStore(Builder.CreateAdd(N, ConstantInt::get(Int64Ty, 1)), Slot);
+                    }
+                }
+                return 2 * Branches.size();
+            }
+
+            // Turn the counters of B into IR profile data on its retained module:
+            // an entry count, branch weights and the session-wide profile
+            // summary, then outline the cold arms with hot/cold splitting.
+            void applyProfile(StringRef Name, FunctionBody &B, ProfileSummary &Summary) {
+                B.IR.withModuleDo([&](Module &M) {
+                    Function *F = M.getFunction(getImplName(Name));
+                    F->setEntryCount(Function::ProfileCount(B.Calls, Function::PCT_Real));
+                    MDBuilder MDB(M.getContext());
+                    for (auto &BB: *F) {
+                        auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
+                        MDNode *Tag = BI ? BI->getMetadata("ks.prof") : nullptr;
+                        if (!Tag)
+                            continue;
+                        uint64_t K = mdconst::extract<ConstantInt>(Tag->getOperand(0))->getZExtValue();
+                        uint64_t Taken = B.BranchCounts[2 * K], NotTaken = B.BranchCounts[2 * K + 1];
+                        // branch weights are 32 bit
+                        uint64_t Scale = std::max(Taken, NotTaken) / UINT32_MAX + 1;
+                        BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(
+                                Taken / Scale, NotTaken / Scale));
+                    }
+                    if (HotOptimizer)
+                        HotOptimizer(*F);
+                    if (HugePages != HugePageMode::None)
+                        F->setSection(HotSection);
+                    TieredIRCompiler::setTier(M, TieredIRCompiler::Optimized);
+                    M.setProfileSummary(Summary.getMD(M.getContext()), ProfileSummary::PSK_Instr);
+
+                    LoopAnalysisManager LAM;
+                    FunctionAnalysisManager FAM;
+                    CGSCCAnalysisManager CGAM;
+                    ModuleAnalysisManager MAM;
+                    PassBuilder PB;
+                    PB.registerModuleAnalyses(MAM);
+                    PB.registerCGSCCAnalyses(CGAM);
+                    PB.registerFunctionAnalyses(FAM);
+                    PB.registerLoopAnalyses(LAM);
+                    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+                    ModulePassManager MPM;
+                    MPM.addPass(HotColdSplittingPass());
+                    MPM.run(M, MAM);
+                });
+            }
+
+            // Summarize all call and branch counters the way an instrumented
+            // profile would be, so the profile summary analysis can tell hot and
+            // cold blocks apart.
+            std::unique_ptr<ProfileSummary> buildProfileSummary() {
+                std::vector<uint64_t> Counts;
+                uint64_t Total = 0, MaxFunctionCount = 0, MaxInternalCount = 0;
+                for (auto &[Name, B]: Bodies) {
+                    Counts.push_back(B.Calls);
+                    MaxFunctionCount = std::max(MaxFunctionCount, B.Calls);
+                    for (unsigned I = 0; I != B.NumBranchCounts; ++I) {
+                        Counts.push_back(B.BranchCounts[I]);
+                        MaxInternalCount = std::max(MaxInternalCount, B.BranchCounts[I]);
+                    }
+                }
+                std::sort(Counts.begin(), Counts.end(), std::greater<uint64_t>());
+                for (uint64_t C: Counts)
+                    Total += C;
+
+                // for each cutoff, the smallest count among the hottest counts
+                // that together make up that fraction of the total
+                SummaryEntryVector Detailed;
+                uint64_t Sum = 0;
+                size_t I = 0;
+                for (uint32_t Cutoff: ProfileSummaryBuilder::DefaultCutoffs) {
+                    uint64_t Needed = static_cast<uint64_t>(
+                            static_cast<double>(Total) * Cutoff / ProfileSummary::Scale);
+                    while (I < Counts.size() && (Sum < Needed || I == 0))
+                        Sum += Counts[I++];
+                    Detailed.emplace_back(Cutoff, I ? Counts[I - 1] : 0, I);
+                }
+                return std::make_unique<ProfileSummary>(
+                        ProfileSummary::PSK_Instr, Detailed, Total,
+                        std::max(MaxFunctionCount, MaxInternalCount), MaxInternalCount,
+                        MaxFunctionCount, Counts.size(), Bodies.size());
+            }
+
+            // Order Names so that each function is followed by the callees it
+            // reaches directly, most called first, starting from the hottest.
+            std::vector<std::string> orderByCallGraph(std::vector<std::string> Names) {
+                auto Hotter = [this](const std::string &L, const std::string &R) {
+                    return Bodies[L].Calls > Bodies[R].Calls;
+                };
+                std::set<std::string> Candidates(Names.begin(), Names.end()), Placed;
+                std::vector<std::string> Order;
+                std::function<void(const std::string &)> Place = [&](const std::string &Name) {
+                    if (!Candidates.count(Name) || !Placed.insert(Name).second)
+                        return;
+                    Order.push_back(Name);
+                    std::vector<std::string> Callees;
+                    Bodies[Name].IR.withModuleDo([&](Module &M) {
+                        for (auto &G: M)
+                            if (G.isDeclaration() && Candidates.count(G.getName().str()))
+                                Callees.push_back(G.getName().str());
+                    });
+                    std::sort(Callees.begin(), Callees.end(), Hotter);
+                    for (auto &Callee: Callees)
+                        Place(Callee);
+                };
+                std::sort(Names.begin(), Names.end(), Hotter);
+                for (auto &Name: Names)
+                    Place(Name);
+                return Order;
+            }
+
+            void notifyLoaded(MaterializationResponsibility &R, const object::ObjectFile &Obj) {
+                std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                for (auto &KV: R.getSymbols()) {
+                    auto P = PendingCallees.find(KV.first);
+                    if (P != PendingCallees.end()) {
+                        speculate(P->second);
+                        PendingCallees.erase(P);
+                    }
+                    auto I = BodiesByImplSymbol.find(KV.first);
+                    if (I == BodiesByImplSymbol.end())
+                        continue;
+                    uint64_t Size = 0;
+                    for (auto &Sec: Obj.sections())
+                        if (Sec.isText() || Sec.isData() || Sec.isBSS())
+                            Size += Sec.getSize();
+                    I->second->CodeSize = Size;
+                    ResidentCodeSize += Size;
+                    speculate(I->second->Callees);
+                    return;
+                }
+            }
+
+            // Point the stub for Name at a fresh lazy call-through trampoline; the
+            // next call compiles (if needed) and links the body, then patches the
+            // stub to jump straight to it.
+            Error armStub(StringRef Name) {
+                auto StubName = Mangle(Name);
+                auto Trampoline = EPCIU->getLazyCallThroughManager().getCallThroughTrampoline(
+                        ImplJD, Mangle(getImplName(Name)),
+                        [this, StubName](ExecutorAddr ResolvedAddr) -> Error {
+                            return ISM->updatePointer(*StubName, ResolvedAddr);
+                        });
+                if (!Trampoline)
+                    return Trampoline.takeError();
+                return ISM->updatePointer(*StubName, *Trampoline);
+            }
+
+            Error evict(StringRef Name, FunctionBody &B) {
+                if (auto Err = B.RT->remove())
+                    return Err;
+                ResidentCodeSize -= B.CodeSize;
+                B.CodeSize = 0;
+                B.RT = ImplJD.createResourceTracker();
+                if (auto Err = CompileLayer.add(B.RT, cloneToNewContext(B.IR)))
+                    return Err;
+                return armStub(Name);
+            }
+
+            // Session code searches its own dylib, then the imported libraries,
+            // the prelude and the runtime. Bodies call each other through the
+            // stubs in MainJD.
+            void updateLinkOrders() {
+                JITDylibSearchOrder Shared;
+                for (auto *JD: LibraryJDs)
+                    Shared.emplace_back(JD, JITDylibLookupFlags::MatchExportedSymbolsOnly);
+                if (PreludeJD)
+                    Shared.emplace_back(PreludeJD, JITDylibLookupFlags::MatchExportedSymbolsOnly);
+                Shared.emplace_back(&RuntimeJD, JITDylibLookupFlags::MatchExportedSymbolsOnly);
+
+                auto Main = Shared;
+                Main.insert(Main.begin(), {&MainJD, JITDylibLookupFlags::MatchAllSymbols});
+                MainJD.setLinkOrder(Main, false);
+                auto Impl = Main;
+                Impl.insert(Impl.begin(), {&ImplJD, JITDylibLookupFlags::MatchAllSymbols});
+                ImplJD.setLinkOrder(Impl, false);
+                // libraries may call back into session definitions
+                for (auto *JD: LibraryJDs) {
+                    auto Library = Main;
+                    Library.insert(Library.begin(), {JD, JITDylibLookupFlags::MatchAllSymbols});
+                    JD->setLinkOrder(Library, false);
+                }
+                for (auto *JD: TenantJDs)
+                    setTenantLinkOrder(*JD);
+            }
+
+            // A tenant sees itself, the prelude and the runtime; never the
+            // session, its libraries or other tenants.
+            void setTenantLinkOrder(JITDylib &JD) {
+                JITDylibSearchOrder Tenant = {{&JD, JITDylibLookupFlags::MatchAllSymbols}};
+                if (PreludeJD)
+                    Tenant.emplace_back(PreludeJD, JITDylibLookupFlags::MatchExportedSymbolsOnly);
+                Tenant.emplace_back(&RuntimeJD, JITDylibLookupFlags::MatchExportedSymbolsOnly);
+                JD.setLinkOrder(Tenant, false);
+            }
+
+            // Drop the code and bookkeeping of a body that is being replaced,
+            // keeping its stub and its call counter symbol. The counter restarts,
+            // as the hot policy is about the new body; the total is kept.
+            Error discardBody(StringRef Name, FunctionBody &B) {
+                if (auto Err = B.RT->remove())
+                    return Err;
+                ResidentCodeSize -= B.CodeSize;
+                if (B.NumBranchCounts)
+                    if (auto Err = MainJD.remove({Mangle(getBranchCounterName(Name))}))
+                        return Err;
+                uint64_t EarlierCalls = B.EarlierCalls + B.Calls;
+                B = FunctionBody();
+                B.EarlierCalls = EarlierCalls;
+                return Error::success();
+            }
 
         public:
             KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
+                            std::unique_ptr<EPCIndirectionUtils> EPCIU,
                             JITTargetMachineBuilder JTMB, DataLayout DL)
-                    : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                    : ES(std::move(ES)), EPCIU(std::move(EPCIU)), DL(std::move(DL)),
+                      Mangle(*this->ES, this->DL),
+                      HotSection(getHotSectionName(JTMB.getTargetTriple())),
                       ObjectLayer(*this->ES,
-                                  []() { return std::make_unique<SectionMemoryManager>(); }),
+                                  [this]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                                      if (HugePages == HugePageMode::None)
+                                          return std::make_unique<SectionMemoryManager>();
+                                      return std::make_unique<HugePageMemoryManager>(HotArena, Arena);
+                                  }),
                       CompileLayer(*this->ES, ObjectLayer,
-                                   std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-                      MainJD(this->ES->createBareJITDylib("<main>")) {
-                MainJD.addGenerator(
+                                   std::make_unique<TieredIRCompiler>(std::move(JTMB))),
+                      MainJD(this->ES->createBareJITDylib("<main>")),
+                      ImplJD(this->ES->createBareJITDylib("<impl>")),
+                      RuntimeJD(this->ES->createBareJITDylib("<runtime>")),
+                      ISM(this->EPCIU->createIndirectStubsManager()) {
+                RuntimeJD.addGenerator(
                         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
                                 DL.getGlobalPrefix())));
+                updateLinkOrders();
+                ObjectLayer.setNotifyLoaded(
+                        [this](MaterializationResponsibility &R, const object::ObjectFile &Obj,
+                               const RuntimeDyld::LoadedObjectInfo &) { notifyLoaded(R, Obj); });
                 if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
                     ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
                     ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
@@ -62,41 +545,462 @@ namespace llvm {
             }
 
             ~KaleidoscopeJIT() {
+                {
+                    std::lock_guard<std::mutex> Lock(SpeculationMutex);
+                    StopSpeculation = true;
+                }
+                SpeculationCV.notify_all();
+                for (auto &T: SpeculationThreads)
+                    T.join();
                 if (auto Err = ES->endSession())
                     ES->reportError(std::move(Err));
+                if (auto Err = EPCIU->cleanup())
+                    ES->reportError(std::move(Err));
             }
 
-            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-                auto EPC = SelfExecutorProcessControl::Create();
+            // With CompileThreads > 1, up to that many materializations run on
+            // threads of their own, so the definitions requested by one lookup
+            // are compiled in parallel.
+            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(unsigned CompileThreads = 1) {
+                std::unique_ptr<TaskDispatcher> Dispatcher;
+                if (CompileThreads > 1)
+                    Dispatcher = std::make_unique<BoundedTaskDispatcher>(CompileThreads);
+                auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(Dispatcher));
                 if (!EPC)
                     return EPC.takeError();
 
                 auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-                JITTargetMachineBuilder JTMB(
-                        ES->getExecutorProcessControl().getTargetTriple());
+                auto EPCIU = EPCIndirectionUtils::Create(*ES);
+                if (!EPCIU)
+                    return EPCIU.takeError();
+
+                (*EPCIU)->createLazyCallThroughManager(
+                        *ES, ExecutorAddr::fromPtr(&handleLazyCallThroughError));
 
-                auto DL = JTMB.getDefaultDataLayoutForTarget();
+                if (auto Err = setUpInProcessLCTMReentryViaEPCIU(**EPCIU))
+                    return std::move(Err);
+
+                // The code runs in this process, so it can use every feature of
+                // the host CPU rather than the baseline of its triple
+                auto JTMB = JITTargetMachineBuilder::detectHost();
+                if (!JTMB)
+                    return JTMB.takeError();
+
+                auto DL = JTMB->getDefaultDataLayoutForTarget();
                 if (!DL)
                     return DL.takeError();
 
-                return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                                         std::move(*DL));
+                return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*EPCIU),
+                                                         std::move(*JTMB), std::move(*DL));
             }
 
             const DataLayout &getDataLayout() const { return DL; }
 
             JITDylib &getMainJITDylib() { return MainJD; }
 
+            // Anonymous expressions run once, so they always use the fast codegen tier.
             Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
                 if (!RT)
                     RT = MainJD.getDefaultResourceTracker();
+                TSM.withModuleDo([](Module &M) { TieredIRCompiler::setTier(M, TieredIRCompiler::Fast); });
+                if (!SpeculationThreads.empty()) {
+                    std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                    TSM.withModuleDo([&](Module &M) {
+                        auto Callees = collectCallees(M);
+                        for (auto &F: M)
+                            if (!F.isDeclaration())
+                                PendingCallees[Mangle(F.getName())] = Callees;
+                    });
+                }
                 return CompileLayer.add(RT, std::move(TSM));
             }
 
+            // Add a module holding the definition of Name. The body is renamed to
+            // Name$impl and instrumented with a call counter, and Name itself
+            // becomes a stub that can be re-pointed when the body is evicted.
+            // If Name is already defined, or is an alias, the new body replaces
+            // the old one behind the existing stub, so code that calls Name
+            // does not need to be recompiled. Like enforceCodeBudget, replacing
+            // a body must only happen while no JIT'd code is on the stack.
+            Error addFunction(StringRef Name, ThreadSafeModule TSM) {
+                std::unique_lock<std::recursive_mutex> Lock(StateMutex);
+                auto Existing = Bodies.find(Name.str());
+                bool Redefining = Existing != Bodies.end();
+                bool HasStub = Redefining || AliasTargets.erase(Name.str());
+                if (Redefining) {
+                    // a speculation thread may be compiling the old body
+                    Lock.unlock();
+                    pauseSpeculation();
+                    Lock.lock();
+                    if (auto Err = discardBody(Name, Existing->second))
+                        return Err;
+                }
+                FunctionBody &B = Bodies[Name.str()];
+
+                TSM.withModuleDo([&](Module &M) {
+                    TieredIRCompiler::setTier(M, FastDefinitions ? TieredIRCompiler::Fast
+                                                                 : TieredIRCompiler::Optimized);
+                    B.Callees = collectCallees(M);
+                    Function *F = M.getFunction(Name);
+                    F->setName(getImplName(Name));
+                    if (ProfileBranches)
+                        B.NumBranchCounts = instrumentBranches(*F, Name);
+                    auto *Int64Ty = Type::getInt64Ty(M.getContext());
+                    auto *Counter = M.getOrInsertGlobal(getCounterName(Name), Int64Ty);
+                    IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+                    Value *Calls = Builder.CreateLoad(Int64Ty, Counter);
+                    Builder.CreateStore(Builder.CreateAdd(Calls, ConstantInt::get(Int64Ty, 1)),
+                                        Counter);
+                });
+
+                if (!Redefining)
+                    if (auto Err = MainJD.define(absoluteSymbols(
+                            {{Mangle(getCounterName(Name)),
+                              ExecutorSymbolDef(ExecutorAddr::fromPtr(&B.Calls),
+                                                JITSymbolFlags::Exported)}})))
+                        return Err;
+
+                if (B.NumBranchCounts) {
+                    B.BranchCounts = std::make_unique<uint64_t[]>(B.NumBranchCounts);
+                    if (auto Err = MainJD.define(absoluteSymbols(
+                            {{Mangle(getBranchCounterName(Name)),
+                              ExecutorSymbolDef(ExecutorAddr::fromPtr(B.BranchCounts.get()),
+                                                JITSymbolFlags::Exported)}})))
+                        return Err;
+                }
+
+                BodiesByImplSymbol[Mangle(getImplName(Name))] = &B;
+                if (RetainIR)
+                    B.IR = cloneToNewContext(TSM);
+                B.RT = ImplJD.createResourceTracker();
+                if (auto Err = CompileLayer.add(B.RT, std::move(TSM)))
+                    return Err;
+
+                if (!HasStub)
+                    if (auto Err = ISM->createStub(*Mangle(Name), ExecutorAddr(),
+                                                   JITSymbolFlags::Exported | JITSymbolFlags::Callable))
+                        return Err;
+                if (auto Err = armStub(Name))
+                    return Err;
+                if (!HasStub)
+                    if (auto Err = MainJD.define(absoluteSymbols({{Mangle(Name), ISM->findStub(*Mangle(Name), true)}})))
+                        return Err;
+
+                // compiled code already calls this one
+                auto W = WantedCallees.find(Name.str());
+                if (W != WantedCallees.end()) {
+                    uint64_t Sites = W->second;
+                    WantedCallees.erase(W);
+                    speculate({{Sites, Name.str()}});
+                }
+                return Error::success();
+            }
+
+            // Compile M with the optimizing profile, e.g. to cache the result.
+            Expected<std::unique_ptr<MemoryBuffer>> compileToObject(Module &M) {
+                TieredIRCompiler::setTier(M, TieredIRCompiler::Optimized);
+                return getTieredCompiler()(M);
+            }
+
+            // Link precompiled objects into a JITDylib of their own, with Aliases
+            // (name -> target) defined next to them. Session code sees their
+            // definitions after its own, and they see the session's definitions
+            // and the process symbols.
+            Error addLibrary(StringRef Name, std::vector<std::unique_ptr<MemoryBuffer>> Objects,
+                             const std::map<std::string, std::string> &Aliases = {}) {
+                auto JD = ES->createJITDylib(Name.str());
+                if (!JD)
+                    return JD.takeError();
+                LibraryJDs.push_back(&*JD);
+                updateLinkOrders();
+                for (auto &Obj: Objects)
+                    if (auto Err = ObjectLayer.add(*JD, std::move(Obj)))
+                        return Err;
+                if (Aliases.empty())
+                    return Error::success();
+                SymbolAliasMap AliasMap;
+                for (auto &[Alias, Target]: Aliases)
+                    AliasMap[Mangle(Alias)] = {Mangle(Target), JITSymbolFlags::Exported | JITSymbolFlags::Callable};
+                return JD->define(symbolAliases(std::move(AliasMap)));
+            }
+
+            // Compile every definition into an object of its own for a snapshot:
+            // the body under its source name, with its counters made private so
+            // the object links without this session. Needs the retained IR.
+            Expected<std::vector<std::pair<std::string, std::unique_ptr<MemoryBuffer>>>> compileDefinitions() {
+                std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                std::vector<std::pair<std::string, std::unique_ptr<MemoryBuffer>>> Objects;
+                for (auto &[Name, B]: Bodies) {
+                    if (!B.IR)
+                        return make_error<StringError>("The IR of " + Name + " was not kept",
+                                                       inconvertibleErrorCode());
+                    auto TSM = cloneToNewContext(B.IR);
+                    auto Obj = TSM.withModuleDo([&, &Name = Name](Module &M) {
+                        M.getFunction(getImplName(Name))->setName(Name);
+                        for (auto *Counter: {M.getNamedGlobal(getCounterName(Name)),
+                                             M.getNamedGlobal(getBranchCounterName(Name))}) {
+                            if (!Counter)
+                                continue;
+                            Counter->setInitializer(Constant::getNullValue(Counter->getValueType()));
+                            Counter->setLinkage(GlobalValue::InternalLinkage);
+                        }
+                        return compileToObject(M);
+                    });
+                    if (!Obj)
+                        return Obj.takeError();
+                    Objects.emplace_back(Name, std::move(*Obj));
+                }
+                return std::move(Objects);
+            }
+
+            // Link the precompiled prelude. It is searched after the session's
+            // own definitions and libraries, and resolves only against the
+            // runtime, so it never depends on a session.
+            Error setPrelude(std::unique_ptr<MemoryBuffer> Obj) {
+                if (PreludeJD)
+                    return make_error<StringError>("The prelude is already set",
+                                                   inconvertibleErrorCode());
+                PreludeJD = &ES->createBareJITDylib("<prelude>");
+                PreludeJD->setLinkOrder({{&RuntimeJD, JITDylibLookupFlags::MatchExportedSymbolsOnly}});
+                updateLinkOrders();
+                return ObjectLayer.add(*PreludeJD, std::move(Obj));
+            }
+
+            // Run Optimize on the IR of hot definitions when they are recompiled,
+            // after their profile has been attached.
+            void setHotOptimizer(std::function<void(Function &)> Optimize) {
+                HotOptimizer = std::move(Optimize);
+            }
+
+            // Use a low-latency codegen profile for anonymous expressions, and for
+            // definitions as well if ForDefinitions is set (they are expected to
+            // be recompiled by recompileHotFunctions once they turn out hot).
+            void setFastCodeGen(FastCodeGenMode Mode, bool ForDefinitions) {
+                getTieredCompiler().setFastMode(Mode);
+                FastDefinitions = Mode != FastCodeGenMode::Off && ForDefinitions;
+            }
+
+            // Report the machine code generation latency of every module.
+            void setCodeGenStats(bool Enable) { getTieredCompiler().setStats(Enable); }
+
+            // Compile the callees of newly compiled code on Threads background
+            // threads (0 disables speculation). Must be set before code is added.
+            void setSpeculationThreads(unsigned Threads) {
+                for (unsigned I = 0; I != Threads; ++I)
+                    SpeculationThreads.emplace_back([this]() { runSpeculation(); });
+            }
+
+            // Limit the machine code kept for named definitions to Bytes (0 means
+            // unlimited). The budget is enforced by enforceCodeBudget.
+            void setCodeBudget(uint64_t Bytes) { CodeBudget = Bytes; }
+
+            // Keep a copy of each definition's IR for recompilation after eviction.
+            // Turning this off keeps memory flat for long streams of definitions.
+            void setRetainIR(bool Retain) { RetainIR = Retain; }
+
+            // Define Name as another name for the definition Target, sharing its
+            // code, counters and recompilation. Name gets a stub of its own that
+            // jumps to Target's stub, so it can be given a body of its own later
+            // (see addFunction) without relinking its callers.
+            Error addAlias(StringRef Name, StringRef Target) {
+                std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                ExecutorAddr TargetStub = ISM->findStub(*Mangle(Target), true).getAddress();
+                if (!TargetStub)
+                    return make_error<StringError>("Unknown definition " + Target,
+                                                   inconvertibleErrorCode());
+                if (AliasTargets.count(Name.str())) {
+                    AliasTargets[Name.str()] = Target.str();
+                    return ISM->updatePointer(*Mangle(Name), TargetStub);
+                }
+                if (Bodies.count(Name.str()))
+                    return make_error<StringError>("Duplicate definition of " + Name,
+                                                   inconvertibleErrorCode());
+                if (auto Err = ISM->createStub(*Mangle(Name), TargetStub,
+                                               JITSymbolFlags::Exported | JITSymbolFlags::Callable))
+                    return Err;
+                AliasTargets[Name.str()] = Target.str();
+                return MainJD.define(absoluteSymbols({{Mangle(Name), ISM->findStub(*Mangle(Name), true)}}));
+            }
+
+            // Names whose stub points at the one of Target.
+            std::vector<std::string> getAliasesOf(StringRef Target) {
+                std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                std::vector<std::string> Names;
+                for (auto &[Name, AliasTarget]: AliasTargets)
+                    if (AliasTarget == Target)
+                        Names.push_back(Name);
+                return Names;
+            }
+
+            // Compile the body of Name right away instead of on its first call, so
+            // its module and LLVMContext are released immediately.
+            Error compileNow(StringRef Name) {
+                return ES->lookup({&ImplJD}, Mangle(getImplName(Name))).takeError();
+            }
+
+            // Compile every body and point its stub straight at the code, so that
+            // running JIT'd code never enters the JIT again. This is what a forked
+            // process needs, as it cannot compile.
+            Error compileAll() {
+                std::unique_lock<std::recursive_mutex> Lock(StateMutex);
+                SymbolLookupSet Symbols;
+                for (auto &[Name, B]: Bodies)
+                    Symbols.add(Mangle(getImplName(Name)));
+                Lock.unlock();
+                auto Addrs = ES->lookup(makeJITDylibSearchOrder(&ImplJD), std::move(Symbols));
+                if (!Addrs)
+                    return Addrs.takeError();
+                // no speculative compile may hold a lock across the fork
+                pauseSpeculation();
+                Lock.lock();
+                for (auto &[Name, B]: Bodies) {
+                    auto I = Addrs->find(Mangle(getImplName(Name)));
+                    if (I != Addrs->end())
+                        if (auto Err = ISM->updatePointer(*Mangle(Name), I->second.getAddress()))
+                            return Err;
+                }
+                return Error::success();
+            }
+
+            // Compile several bodies with a single lookup; each one is a
+            // separate module, so they are compiled concurrently when the JIT
+            // was created with more than one compile thread.
+            Error compileAllNow(ArrayRef<std::string> Names) {
+                SymbolLookupSet Symbols;
+                for (auto &Name: Names)
+                    Symbols.add(Mangle(getImplName(Name)));
+                return ES->lookup(makeJITDylibSearchOrder(&ImplJD), std::move(Symbols)).takeError();
+            }
+
+            uint64_t getResidentCodeSize() const { return ResidentCodeSize; }
+
+            // Number of calls to Name so far, across all of its bodies.
+            uint64_t getCallCount(StringRef Name) {
+                std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                auto It = Bodies.find(Name.str());
+                return It == Bodies.end() ? 0 : It->second.EarlierCalls + It->second.Calls;
+            }
+
+            // Allocate code from large huge-page backed regions. Must be set
+            // before any code is added.
+            void setHugePageMode(HugePageMode Mode) {
+                HugePages = Mode;
+                if (Mode != HugePageMode::None) {
+                    HotArena = std::make_shared<CodeArena>(Mode);
+                    Arena = std::make_shared<CodeArena>(Mode);
+                }
+            }
+
+            // Count how often each if/then/else arm runs in newly added
+            // definitions, for use by recompileHotFunctions.
+            void setProfileBranches(bool Profile) { ProfileBranches = Profile; }
+
+            // Recompile definitions called at least MinCalls times using their
+            // profile: cold arms are split out of line, and the hot parts are
+            // compiled in call-graph order so callers sit next to their callees
+            // (in the hot arena when huge pages are on). Like enforceCodeBudget
+            // this must only run while no JIT'd code is on the stack.
+            Error recompileHotFunctions(uint64_t MinCalls) {
+                std::unique_lock<std::recursive_mutex> Lock(StateMutex);
+                std::vector<std::string> Hot;
+                for (auto &[Name, B]: Bodies)
+                    if (!B.Hot && B.IR && B.CodeSize && B.Calls >= MinCalls)
+                        Hot.push_back(Name);
+                if (Hot.empty())
+                    return Error::success();
+
+                // in-flight compiles need the lock to finish
+                Lock.unlock();
+                pauseSpeculation();
+                Lock.lock();
+                auto Summary = buildProfileSummary();
+                auto Order = orderByCallGraph(std::move(Hot));
+                for (auto &Name: Order) {
+                    FunctionBody &B = Bodies[Name];
+                    B.Hot = true;
+                    applyProfile(Name, B, *Summary);
+                    if (auto Err = evict(Name, B))
+                        return Err;
+                }
+                // compiling in order places the code in order; a speculation
+                // thread may be compiling one of them and need the lock meanwhile
+                Lock.unlock();
+                for (auto &Name: Order)
+                    if (auto Err = compileNow(Name))
+                        return Err;
+                return Error::success();
+            }
+
+            // Evict the least recently called bodies until resident code fits the
+            // budget. Recency is sampled from the call counters once per sweep, so
+            // this must only run while no JIT'd code is on the stack, e.g. between
+            // top-level expressions.
+            Error enforceCodeBudget() {
+                std::unique_lock<std::recursive_mutex> Lock(StateMutex);
+                ++SweepEpoch;
+                std::vector<std::pair<uint64_t, std::string>> Resident;
+                for (auto &[Name, B]: Bodies) {
+                    if (B.Calls != B.CallsAtLastSweep) {
+                        B.CallsAtLastSweep = B.Calls;
+                        B.LastUsed = SweepEpoch;
+                    }
+                    if (B.CodeSize && B.IR)
+                        Resident.emplace_back(B.LastUsed, Name);
+                }
+                if (!CodeBudget || ResidentCodeSize <= CodeBudget)
+                    return Error::success();
+
+                Lock.unlock();
+                pauseSpeculation();
+                Lock.lock();
+                std::sort(Resident.begin(), Resident.end());
+                for (auto &[LastUsed, Name]: Resident) {
+                    if (ResidentCodeSize <= CodeBudget)
+                        break;
+                    if (auto Err = evict(Name, Bodies[Name]))
+                        return Err;
+                }
+                return Error::success();
+            }
+
             Expected<ExecutorSymbolDef> lookup(StringRef Name) {
                 return ES->lookup({&MainJD}, Mangle(Name.str()));
             }
+
+            // Tenants are isolated namespaces for a host that serves many clients
+            // from one process, so that two of them can both define f. A tenant's
+            // modules are compiled as they are, without stubs, counters or
+            // eviction: creating a tenant costs a dylib and a link order, and
+            // removing it frees all of its code at once.
+            Expected<JITDylib &> createTenant(StringRef Name) {
+                auto JD = ES->createJITDylib(("<tenant " + Name + ">").str());
+                if (!JD)
+                    return JD.takeError();
+                std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                setTenantLinkOrder(*JD);
+                TenantJDs.insert(&*JD);
+                return *JD;
+            }
+
+            // No code of the tenant may be on the stack.
+            Error removeTenant(JITDylib &JD) {
+                {
+                    std::lock_guard<std::recursive_mutex> Lock(StateMutex);
+                    TenantJDs.erase(&JD);
+                }
+                return ES->removeJITDylib(JD);
+            }
+
+            Error addToTenant(JITDylib &JD, ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+                if (!RT)
+                    RT = JD.getDefaultResourceTracker();
+                return CompileLayer.add(RT, std::move(TSM));
+            }
+
+            Expected<ExecutorSymbolDef> lookupInTenant(JITDylib &JD, StringRef Name) {
+                return ES->lookup({&JD}, Mangle(Name.str()));
+            }
         };
 
     } // end namespace orc
@@ -0,0 +1,197 @@
+//===- SignatureRegistry.h - Concurrent function signature table -*- C++ -*-===//
+//
+// Contains a registry mapping function names to their signatures that many
+// compile threads can consult at once. Lookups never take a lock; insertions
+// lock one of several shards, so concurrent writers rarely meet.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_SIGNATUREREGISTRY_H
+#define KALEIDOSCOPE_SIGNATUREREGISTRY_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/CallingConv.h"
+#include "llvm/Support/MemAlloc.h"
+#include "llvm/Support/xxhash.h"
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace llvm {
+
+    // FunctionSignature - all that is kept of a prototype once it has been code
+    // generated: enough to declare the function again in later modules.
+    struct FunctionSignature {
+        unsigned Arity;
+        CallingConv::ID CC;
+    };
+
+    class SignatureRegistry {
+    public:
+        // Symbol - an interned name. Symbols are never freed before the
+        // registry, so a compile thread may keep a pointer to one and read its
+        // signature again without hashing the name.
+        class Symbol {
+        public:
+            StringRef getName() const { return {reinterpret_cast<const char *>(this + 1), Length}; }
+
+            std::optional<FunctionSignature> get() const {
+                uint64_t Packed = Signature.load(std::memory_order_acquire);
+                if (!(Packed & Valid))
+                    return std::nullopt;
+                return FunctionSignature{static_cast<unsigned>(Packed),
+                                         static_cast<CallingConv::ID>((Packed >> 32) & 0x3ff)};
+            }
+
+            void set(FunctionSignature Sig) {
+                Signature.store(Valid | (uint64_t(Sig.CC & 0x3ff) << 32) | Sig.Arity, std::memory_order_release);
+            }
+
+        private:
+            friend class SignatureRegistry;
+            static constexpr uint64_t Valid = uint64_t(1) << 63;
+
+            std::atomic<uint64_t> Signature{0};
+            uint64_t Hash;
+            size_t Length;
+            // followed by the name and a terminating zero
+
+            Symbol(uint64_t Hash, size_t Length) : Hash(Hash), Length(Length) {}
+        };
+
+        SignatureRegistry() = default;
+        SignatureRegistry(const SignatureRegistry &) = delete;
+        SignatureRegistry &operator=(const SignatureRegistry &) = delete;
+
+        ~SignatureRegistry() {
+            for (auto &S: Shards) {
+                Table *T = S.Current.load(std::memory_order_relaxed);
+                for (size_t I = 0; T && I <= T->Mask; ++I)
+                    if (Symbol *Sym = T->Slots[I].load(std::memory_order_relaxed)) {
+                        Sym->~Symbol();
+                        free(Sym);
+                    }
+            }
+        }
+
+        // Lock-free; nullptr if Name was never interned.
+        const Symbol *find(StringRef Name) const {
+            uint64_t Hash = xxHash64(Name);
+            return findIn(getShard(Hash), Name, Hash);
+        }
+
+        Symbol &intern(StringRef Name) {
+            uint64_t Hash = xxHash64(Name);
+            Shard &S = getShard(Hash);
+            if (Symbol *Sym = findIn(S, Name, Hash))
+                return *Sym;
+            std::lock_guard<std::mutex> Lock(S.WriteMutex);
+            // another thread may have inserted it since
+            if (Symbol *Sym = findIn(S, Name, Hash))
+                return *Sym;
+            Table *T = S.Current.load(std::memory_order_relaxed);
+            if (!T || (S.Count + 1) * 4 > (T->Mask + 1) * 3)
+                T = grow(S);
+            auto *Mem = static_cast<char *>(safe_malloc(sizeof(Symbol) + Name.size() + 1));
+            auto *Sym = new(Mem) Symbol(Hash, Name.size());
+            memcpy(Mem + sizeof(Symbol), Name.data(), Name.size());
+            Mem[sizeof(Symbol) + Name.size()] = 0;
+            insertInto(*T, Sym, std::memory_order_release);
+            ++S.Count;
+            return *Sym;
+        }
+
+        std::optional<FunctionSignature> lookup(StringRef Name) const {
+            if (const Symbol *Sym = find(Name))
+                return Sym->get();
+            return std::nullopt;
+        }
+
+        void set(StringRef Name, FunctionSignature Sig) { intern(Name).set(Sig); }
+
+        // Calls F(Name, Signature) for every name that has a signature. Names
+        // added concurrently may or may not be visited.
+        template<typename Fn>
+        void forEach(Fn F) const {
+            for (auto &S: Shards) {
+                Table *T = S.Current.load(std::memory_order_acquire);
+                for (size_t I = 0; T && I <= T->Mask; ++I)
+                    if (Symbol *Sym = T->Slots[I].load(std::memory_order_acquire))
+                        if (auto Sig = Sym->get())
+                            F(Sym->getName(), *Sig);
+            }
+        }
+
+    private:
+        static constexpr unsigned ShardBits = 6;
+        static constexpr size_t InitialSlots = 16;
+
+        // Open addressing with linear probing. Slots only ever go from empty
+        // to a symbol, so a reader that races an insertion sees either.
+        struct Table {
+            size_t Mask;
+            std::unique_ptr<std::atomic<Symbol *>[]> Slots;
+
+            explicit Table(size_t Size) : Mask(Size - 1), Slots(new std::atomic<Symbol *>[Size]) {
+                for (size_t I = 0; I < Size; ++I)
+                    Slots[I].store(nullptr, std::memory_order_relaxed);
+            }
+        };
+
+        struct Shard {
+            std::atomic<Table *> Current{nullptr};
+            std::mutex WriteMutex;
+            size_t Count = 0;
+            // Readers may still probe a table that has been replaced, and
+            // there is no cheap way to know when they are done, so outgrown
+            // tables are kept. Together they are smaller than the current one.
+            std::vector<std::unique_ptr<Table>> Tables;
+        };
+
+        Shard Shards[1 << ShardBits];
+
+        Shard &getShard(uint64_t Hash) { return Shards[Hash >> (64 - ShardBits)]; }
+
+        const Shard &getShard(uint64_t Hash) const { return Shards[Hash >> (64 - ShardBits)]; }
+
+        static Symbol *findIn(const Shard &S, StringRef Name, uint64_t Hash) {
+            Table *T = S.Current.load(std::memory_order_acquire);
+            if (!T)
+                return nullptr;
+            for (size_t I = Hash & T->Mask;; I = (I + 1) & T->Mask) {
+                Symbol *Sym = T->Slots[I].load(std::memory_order_acquire);
+                if (!Sym)
+                    return nullptr;
+                if (Sym->Hash == Hash && Sym->getName() == Name)
+                    return Sym;
+            }
+        }
+
+        static void insertInto(Table &T, Symbol *Sym, std::memory_order Order) {
+            size_t I = Sym->Hash & T.Mask;
+            while (T.Slots[I].load(std::memory_order_relaxed))
+                I = (I + 1) & T.Mask;
+            T.Slots[I].store(Sym, Order);
+        }
+
+        // Called with the shard's write lock held.
+        static Table *grow(Shard &S) {
+            Table *Old = S.Current.load(std::memory_order_relaxed);
+            auto New = std::make_unique<Table>(Old ? (Old->Mask + 1) * 2 : InitialSlots);
+            for (size_t I = 0; Old && I <= Old->Mask; ++I)
+                if (Symbol *Sym = Old->Slots[I].load(std::memory_order_relaxed))
+                    insertInto(*New, Sym, std::memory_order_relaxed);
+            Table *T = New.get();
+            S.Tables.push_back(std::move(New));
+            // publishes the copied slots too
+            S.Current.store(T, std::memory_order_release);
+            return T;
+        }
+    };
+
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_SIGNATUREREGISTRY_H
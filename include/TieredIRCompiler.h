@@ -0,0 +1,112 @@
+//===- TieredIRCompiler.h - Per-module choice of codegen profile -*- C++ -*-===//
+//
+// Contains an IRCompiler for IRCompileLayer that compiles modules marked as
+// fast tier with a low-latency code generation profile, and all other modules
+// with the default one.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_TIEREDIRCOMPILER_H
+#define KALEIDOSCOPE_TIEREDIRCOMPILER_H
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CodeGen.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+
+namespace llvm {
+    namespace orc {
+
+        enum class FastCodeGenMode {
+            Off,       // every module gets the default profile
+            FastISel,  // CodeGenOptLevel::None with FastISel
+            GlobalISel // CodeGenOptLevel::None with GlobalISel, SelectionDAG as fallback
+        };
+
+        class TieredIRCompiler : public IRCompileLayer::IRCompiler {
+        public:
+            enum Tier { Fast = 0, Optimized = 1 };
+
+            static void setTier(Module &M, Tier T) {
+                M.setModuleFlag(Module::Warning, "ks.codegen-tier", ConstantAsMetadata::get(
+                        ConstantInt::get(Type::getInt32Ty(M.getContext()), T)));
+            }
+
+            static Tier getTier(const Module &M) {
+                auto *T = mdconst::extract_or_null<ConstantInt>(M.getModuleFlag("ks.codegen-tier"));
+                return T && T->isZero() ? Fast : Optimized;
+            }
+
+            explicit TieredIRCompiler(JITTargetMachineBuilder JTMB)
+                    : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+                      OptimizedJTMB(JTMB), FastJTMB(std::move(JTMB)) {}
+
+            ~TieredIRCompiler() override {
+                if (!Stats)
+                    return;
+                for (auto T: {Fast, Optimized})
+                    fprintf(stderr, "[codegen] %-9s total: %llu modules, %.3f ms\n", getTierName(T),
+                            (unsigned long long) Modules[T], Millis[T]);
+            }
+
+            // Lower the fast tier to CodeGenOptLevel::None, which also selects the
+            // fast register allocator, with the given instruction selector.
+            void setFastMode(FastCodeGenMode Mode) {
+                FastMode = Mode;
+                FastJTMB.setCodeGenOptLevel(CodeGenOptLevel::None);
+                auto &Options = FastJTMB.getOptions();
+                Options.EnableFastISel = Mode == FastCodeGenMode::FastISel;
+                Options.EnableGlobalISel = Mode == FastCodeGenMode::GlobalISel;
+                Options.GlobalISelAbort = GlobalISelAbortMode::Disable;
+            }
+
+            // Print the machine code generation latency of every module.
+            void setStats(bool Enable) { Stats = Enable; }
+
+            Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+                Tier T = FastMode != FastCodeGenMode::Off ? getTier(M) : Optimized;
+                auto Start = std::chrono::steady_clock::now();
+                auto TM = (T == Fast ? FastJTMB : OptimizedJTMB).createTargetMachine();
+                if (!TM)
+                    return TM.takeError();
+                SimpleCompiler C(**TM);
+                auto Obj = C(M);
+                if (Stats) {
+                    double Ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - Start).count();
+                    std::lock_guard<std::mutex> Lock(StatsMutex);
+                    ++Modules[T];
+                    Millis[T] += Ms;
+                    fprintf(stderr, "[codegen] %-24s %-9s %8.3f ms\n", getDefinedName(M).c_str(),
+                            getTierName(T), Ms);
+                }
+                return Obj;
+            }
+
+        private:
+            JITTargetMachineBuilder OptimizedJTMB, FastJTMB;
+            FastCodeGenMode FastMode = FastCodeGenMode::Off;
+            bool Stats = false;
+            std::mutex StatsMutex;
+            uint64_t Modules[2] = {0, 0};
+            double Millis[2] = {0, 0};
+
+            static const char *getTierName(Tier T) { return T == Fast ? "fast" : "optimized"; }
+
+            static std::string getDefinedName(const Module &M) {
+                for (auto &F: M)
+                    if (!F.isDeclaration())
+                        return F.getName().str();
+                return M.getModuleIdentifier();
+            }
+        };
+
+    } // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_TIEREDIRCOMPILER_H
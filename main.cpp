@@ -1,28 +1,82 @@
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/BLAKE3.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/X86TargetParser.h"
+#include "llvm/Transforms/IPO/HotColdSplitting.h"
+#include "llvm/Transforms/IPO/MergeFunctions.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
+#include <array>
+#include <atomic>
+#include <csetjmp>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <optional>
 #include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <functional>
 #include <utility>
 #include <vector>
 #include <map>
+#include <set>
+#include <tuple>
+#include <thread>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 #include "include/KaleidoscopeJIT.h"
+#include "include/SignatureRegistry.h"
 
 /**
  * Kaleidoscope language example
@@ -48,6 +102,178 @@ atan2(sin(.4), cos(42))
 using namespace llvm;
 using namespace llvm::orc;
 
+static cl::opt<uint64_t> CodeBudget(
+        "jit-code-budget",
+        cl::desc("Maximum bytes of machine code kept for definitions; the least "
+                 "recently called ones are evicted and recompiled on demand (0 = unlimited)"),
+        cl::init(0));
+
+static cl::opt<HugePageMode> HugePages(
+        "jit-huge-pages",
+        cl::desc("Back JIT'd code with 2 MiB pages in large contiguous regions "
+                 "(executed from a read/execute view, written through a read/write alias)"),
+        cl::init(HugePageMode::None),
+        cl::values(clEnumValN(HugePageMode::None, "none", "one mapping per object"),
+                   clEnumValN(HugePageMode::Transparent, "transparent", "transparent huge pages"),
+                   clEnumValN(HugePageMode::Explicit, "explicit",
+                              "MAP_HUGETLB pages, falling back to transparent ones")));
+
+static cl::opt<uint64_t> HotCallThreshold(
+        "jit-hot-threshold",
+        cl::desc("Recompile definitions called this many times using their branch "
+                 "profile: cold if/else arms are split out of line and callers are "
+                 "placed next to their callees, in a shared hot region with "
+                 "-jit-huge-pages (0 = off)"),
+        cl::init(0));
+
+static cl::opt<unsigned> SpeculationThreads(
+        "jit-speculate",
+        cl::desc("Compile the callees of newly compiled code on this many background "
+                 "threads, most call sites first (0 = compile on first call)"),
+        cl::init(0));
+
+static cl::opt<FastCodeGenMode> FastCodeGen(
+        "jit-fast-codegen",
+        cl::desc("Low-latency code generation (no codegen optimization, fast register "
+                 "allocation) for anonymous expressions, and for definitions until they "
+                 "are recompiled hot when -jit-hot-threshold is set"),
+        cl::init(FastCodeGenMode::Off),
+        cl::values(clEnumValN(FastCodeGenMode::Off, "off", "default code generation everywhere"),
+                   clEnumValN(FastCodeGenMode::FastISel, "fastisel", "use FastISel"),
+                   clEnumValN(FastCodeGenMode::GlobalISel, "globalisel", "use GlobalISel")));
+
+static cl::opt<bool> CodeGenStats(
+        "jit-codegen-stats",
+        cl::desc("Print the machine code generation latency of each compiled module "
+                 "and per-profile totals at exit"),
+        cl::init(false));
+
+static cl::opt<unsigned> OptBudgetMs(
+        "opt-budget-ms",
+        cl::desc("Total milliseconds of IR optimization to spend on new functions; "
+                 "after that only the light pipeline is used (0 = unlimited)"),
+        cl::init(0));
+
+static cl::opt<bool> OptStats(
+        "opt-stats",
+        cl::desc("Print the optimization level chosen for each function and the time spent"),
+        cl::init(false));
+
+static cl::opt<std::string> ObjectFilename(
+        "emit-obj",
+        cl::desc("Compile the definitions ahead of time into an object file instead "
+                 "of running them"),
+        cl::value_desc("filename"),
+        cl::init(""));
+
+static cl::list<std::string> MultiversionFunctions(
+        "multiversion",
+        cl::desc("With -emit-obj, compile these functions for several x86-64 feature "
+                 "levels (baseline, AVX2, AVX-512) and pick one at load time"),
+        cl::value_desc("function"),
+        cl::CommaSeparated);
+
+static cl::opt<unsigned> CodeGenThreads(
+        "codegen-threads",
+        cl::desc("Generate machine code on up to N threads: with -emit-obj the module is "
+                 "split into N object files, with -stream definitions are compiled N at a time"),
+        cl::init(1));
+
+static cl::opt<std::string> WatchFilename(
+        "watch",
+        cl::desc("Run this script, and run it again each time it changes; only "
+                 "changed definitions are recompiled"),
+        cl::value_desc("file"),
+        cl::init(""));
+
+static cl::opt<std::string> PreludeFilename(
+        "prelude",
+        cl::desc("Standard library compiled once (cached like an import) and linked "
+                 "into a shared, read-only dylib that session code resolves against"),
+        cl::value_desc("file"),
+        cl::init(""));
+
+static cl::opt<std::string> RestoreFilename(
+        "restore",
+        cl::desc("Start from a session snapshot written by snapshot \"file\""),
+        cl::value_desc("file"),
+        cl::init(""));
+
+static cl::opt<unsigned> Workers(
+        "workers",
+        cl::desc("Evaluate top-level expressions in up to N worker processes at a time, so "
+                 "a crashing or runaway expression cannot take the session down (0 = in process)"),
+        cl::init(0));
+
+static cl::opt<unsigned> WorkerTimeoutMs(
+        "worker-timeout-ms",
+        cl::desc("With -workers, kill an evaluation that runs longer than this (0 = no limit)"),
+        cl::init(0));
+
+static cl::opt<bool> Safepoints(
+        "safepoints",
+        cl::desc("Poll for cancellation at function entry and loop back-edges, so that "
+                 "Ctrl-C stops a running expression instead of the session"),
+        cl::init(false));
+
+static cl::opt<unsigned> CpuBudgetMs(
+        "cpu-budget-ms",
+        cl::desc("Cancel a top-level expression once its thread used this much CPU time "
+                 "(implies -safepoints, 0 = no limit)"),
+        cl::init(0));
+
+static cl::opt<uint64_t> InstructionBudget(
+        "instruction-budget",
+        cl::desc("Cancel a top-level expression once it retired this many instructions, "
+                 "counted with perf_event on Linux (implies -safepoints, 0 = no limit)"),
+        cl::init(0));
+
+static cl::opt<std::string> AccountingFilename(
+        "accounting",
+        cl::desc("Append the outcome, CPU time, wall time and instruction count of every "
+                 "top-level expression to this CSV file"),
+        cl::value_desc("file"),
+        cl::init(""));
+
+static cl::list<std::string> FrozenOptions(
+        "frozen",
+        cl::desc("Freeze a global to a value set by the host; code reading it has the "
+                 "value compiled in, and const definitions of it are ignored"),
+        cl::value_desc("name=value"),
+        cl::CommaSeparated);
+
+static cl::opt<std::string> FrozenFilename(
+        "frozen-file",
+        cl::desc("Read frozen globals from this file of name = value lines, and read "
+                 "it again whenever it changes; the code that reads a changed value is "
+                 "recompiled"),
+        cl::value_desc("file"),
+        cl::init(""));
+
+static cl::opt<unsigned> TenantBenchmark(
+        "tenant-bench",
+        cl::desc("Create this many tenants that each define f, call it, then remove "
+                 "them all, and report the latency of each step"),
+        cl::init(0));
+
+static cl::opt<unsigned> SignatureBenchmark(
+        "signature-bench",
+        cl::desc("Generate call-heavy code on 1, 2, 4, ... up to this many threads, "
+                 "resolving callees through the signature registry and through a "
+                 "mutex-guarded map, and report the throughput of both"),
+        cl::init(0));
+
+static cl::opt<bool> StreamMode(
+        "stream",
+        cl::desc("Streaming compilation for very large scripts: keep only compact "
+                 "signatures, compile each definition right away and free its IR, "
+                 "and don't echo IR"),
+        cl::init(false));
+
+static cl::opt<unsigned> MemReportInterval(
+        "mem-report",
+        cl::desc("Print resident memory every N top-level items (0 = off)"),
+        cl::init(0));
 
 /**
  * Lexer
@@ -70,25 +296,52 @@ enum Token {
   tok_else = -8,
   //  loop
   tok_for = -9,
-  tok_in = -10
+  tok_in = -10,
+
+  // modules
+  tok_import = -11,
+  tok_string = -12,
+  tok_snapshot = -13,
+
+  //  loop
+  tok_while = -14,
+  tok_do = -15,
+  tok_break = -16,
+
+  // logical operators, '!' is a plain character
+  tok_and = -17,
+  tok_or = -18,
+
+  // commands
+  tok_const = -19
 };
 
 static std::string IdentifierStr; // Filled in if tok_identifier
 static double NumVal;             // Filled in if tok_number
+static std::string StringVal;     // Filled in if tok_string
 
-// gettok return the next token from standard input
+// the lexer reads from standard input, or from the file being watched
+static FILE *Input = stdin;
+static int LastChar = ' ';
+// directory that relative imports are resolved against
+static std::string ImportDir;
+
+static int readChar() {
+  return getc(Input);
+}
+
+// gettok return the next token from Input
 static int gettok() {
-  static int LastChar = ' ';
 
   // skip any white space
   while (isspace(LastChar)) {
-    LastChar = getchar();
+    LastChar = readChar();
   }
 
   if (isalpha(LastChar)) {
     IdentifierStr = LastChar;
     // is alphanumeric
-    while (isalnum(LastChar = getchar())) {
+    while (isalnum(LastChar = readChar())) {
       IdentifierStr += LastChar;
     }
 
@@ -98,6 +351,9 @@ static int gettok() {
     if (IdentifierStr == "extern") {
       return tok_extern;
     }
+    if (IdentifierStr == "const") {
+      return tok_const;
+    }
     if (IdentifierStr == "if") {
       return tok_if;
     }
@@ -113,15 +369,42 @@ static int gettok() {
     if (IdentifierStr == "in") {
       return tok_in;
     }
+    if (IdentifierStr == "while") {
+      return tok_while;
+    }
+    if (IdentifierStr == "do") {
+      return tok_do;
+    }
+    if (IdentifierStr == "break") {
+      return tok_break;
+    }
+    if (IdentifierStr == "import") {
+      return tok_import;
+    }
+    if (IdentifierStr == "snapshot") {
+      return tok_snapshot;
+    }
     return tok_identifier;
   }
 
+  // "..." on one line
+  if (LastChar == '"') {
+    StringVal.clear();
+    while ((LastChar = readChar()) != '"' && LastChar != EOF && LastChar != '\n') {
+      StringVal += LastChar;
+    }
+    if (LastChar == '"') {
+      LastChar = readChar();
+    }
+    return tok_string;
+  }
+
   // [0-9.]+
   if (isdigit(LastChar) || LastChar == '.') {
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = getchar();
+      LastChar = readChar();
     } while (isdigit(LastChar) || LastChar == '.');
 
     NumVal = strtod(NumStr.c_str(), nullptr);
@@ -131,7 +414,7 @@ static int gettok() {
   // comment
   if (LastChar == '#') {
     do {
-      LastChar = getchar();
+      LastChar = readChar();
     } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
     if (LastChar != EOF) {
       return gettok();
@@ -145,7 +428,12 @@ static int gettok() {
 
   // could possibly an operator like '+', '-'
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = readChar();
+  // '&&' and '||'
+  if ((ThisChar == '&' || ThisChar == '|') && LastChar == ThisChar) {
+    LastChar = readChar();
+    return ThisChar == '&' ? tok_and : tok_or;
+  }
   return ThisChar;
 }
 
@@ -155,13 +443,55 @@ static int gettok() {
  * https://llvm.org/docs/tutorial/MyFirstLanguageFrontend/LangImpl02.html
  */
 
+using StructuralHash = std::array<uint8_t, 16>;
+
+// the value of a const or frozen global, nullptr if Name is none
+static const double *findConstant(const std::string &Name);
+
 namespace {
+// ASTShape - cheap size signals of a function body, see chooseOptLevel()
+  struct ASTShape {
+    unsigned Nodes = 0;
+    bool HasLoop = false;
+  };
+
+// StructuralKey - spells out a function body with parameters and loop
+// variables numbered by binding position and recursive calls marked, so two
+// bodies get the same key exactly when they are identical up to naming
+  struct StructuralKey {
+    std::string Key;
+    const std::string *Self = nullptr;
+    std::vector<std::string> Scope; // innermost binding last
+    std::set<std::string> Callees;  // other functions called
+    std::set<std::string> Globals;  // free variables, i.e. constants
+
+    void addVariable(const std::string &Name) {
+      for (size_t I = Scope.size(); I-- > 0;) {
+        if (Scope[I] == Name) {
+          Key += "v" + std::to_string(I) + ";";
+          return;
+        }
+      }
+      Key += "g" + Name + ";";
+      Globals.insert(Name);
+    }
+  };
+
 // ExprAST - base class for all expression nodes
   class ExprAST {
   public:
     virtual ~ExprAST() = default;
 
     virtual Value *codegen() = 0;
+
+    // add this subtree to Shape
+    virtual void measure(ASTShape &Shape) const = 0;
+
+    // append this subtree to Key
+    virtual void addToKey(StructuralKey &Key) const = 0;
+
+    // 1 if this condition is wrapped in likely(), -1 for unlikely(), else 0
+    virtual int getBranchHint() const { return 0; }
   };
 
 // NumberExprAST - Expression class for numeric literals
@@ -171,6 +501,12 @@ namespace {
     NumberExprAST(double Val) : Val(Val) {}
 
     Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override { ++Shape.Nodes; }
+
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += "n" + utohexstr(DoubleToBits(Val)) + ";";
+    }
   };
 
 // VariableExprAST - Expression class for referencing a variable, like 'a'
@@ -180,6 +516,10 @@ namespace {
     explicit VariableExprAST(const std::string &name) : Name(name) {}
 
     Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override { ++Shape.Nodes; }
+
+    void addToKey(StructuralKey &Key) const override { Key.addVariable(Name); }
   };
 
 // BinaryExprAST - binary operator
@@ -194,6 +534,90 @@ namespace {
             Op(op), LHS(std::move(lhs)), RHS(std::move(rhs)) {}
 
     Value *codegen();
+
+    void measure(ASTShape &Shape) const override {
+      ++Shape.Nodes;
+      LHS->measure(Shape);
+      RHS->measure(Shape);
+    }
+
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += "b";
+      Key.Key += Op;
+      Key.Key += "(";
+      LHS->addToKey(Key);
+      RHS->addToKey(Key);
+      Key.Key += ")";
+    }
+  };
+
+// LogicalExprAST - '&&' and '||'. The right operand is only evaluated when the
+// left one does not decide the result, which is 0 or 1.
+  class LogicalExprAST : public ExprAST {
+    bool IsAnd;
+    std::unique_ptr<ExprAST> LHS, RHS;
+
+  public:
+    LogicalExprAST(bool IsAnd, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
+            : IsAnd(IsAnd), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+
+    Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override {
+      ++Shape.Nodes;
+      LHS->measure(Shape);
+      RHS->measure(Shape);
+    }
+
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += IsAnd ? "l&(" : "l|(";
+      LHS->addToKey(Key);
+      RHS->addToKey(Key);
+      Key.Key += ")";
+    }
+  };
+
+// NotExprAST - '!', 1 if the operand is 0 and 0 otherwise
+  class NotExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Operand;
+
+  public:
+    explicit NotExprAST(std::unique_ptr<ExprAST> Operand) : Operand(std::move(Operand)) {}
+
+    Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override {
+      ++Shape.Nodes;
+      Operand->measure(Shape);
+    }
+
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += "!(";
+      Operand->addToKey(Key);
+      Key.Key += ")";
+    }
+  };
+
+// BranchHintExprAST - likely(cond) and unlikely(cond): the value of cond, and
+// a hint for the branch that tests it
+  class BranchHintExprAST : public ExprAST {
+    bool Likely;
+    std::unique_ptr<ExprAST> Cond;
+
+  public:
+    BranchHintExprAST(bool Likely, std::unique_ptr<ExprAST> Cond) : Likely(Likely), Cond(std::move(Cond)) {}
+
+    Value *codegen() override { return Cond->codegen(); }
+
+    void measure(ASTShape &Shape) const override { Cond->measure(Shape); }
+
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += Likely ? "h+(" : "h-(";
+      Cond->addToKey(Key);
+      Key.Key += ")";
+    }
+
+    int getBranchHint() const override { return Likely ? 1 : -1; }
   };
 
 // CallExprAST - expression class for function calls
@@ -207,6 +631,26 @@ namespace {
             : Callee(Callee), Args(std::move(Args)) {}
 
     Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override {
+      ++Shape.Nodes;
+      for (auto &Arg: Args) {
+        Arg->measure(Shape);
+      }
+    }
+
+    void addToKey(StructuralKey &Key) const override {
+      if (Callee == *Key.Self) {
+        Key.Key += "c@(";
+      } else {
+        Key.Key += "c" + Callee + "(";
+        Key.Callees.insert(Callee);
+      }
+      for (auto &Arg: Args) {
+        Arg->addToKey(Key);
+      }
+      Key.Key += ")";
+    }
   };
 
   // IfExprAST - Expression class for if/then/else
@@ -220,12 +664,38 @@ namespace {
             : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
 
     Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override {
+      ++Shape.Nodes;
+      Cond->measure(Shape);
+      Then->measure(Shape);
+      Else->measure(Shape);
+    }
+
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += "i(";
+      Cond->addToKey(Key);
+      Then->addToKey(Key);
+      Else->addToKey(Key);
+      Key.Key += ")";
+    }
+  };
+
+  // LoopHints - 'unroll N', 'vectorize N' and 'interleave N' on a for loop;
+  // 0 leaves the choice to the cost model, 1 disables the transformation
+  struct LoopHints {
+    unsigned Unroll = 0;
+    unsigned Vectorize = 0;
+    unsigned Interleave = 0;
+
+    bool empty() const { return !Unroll && !Vectorize && !Interleave; }
   };
 
   // ForExprAST - Expression class for "for/in"
   class ForExprAST : public ExprAST {
     std::string VarName;
     std::unique_ptr<ExprAST> Start, End, Step, Body;
+    LoopHints Hints;
 
   public:
     explicit ForExprAST(
@@ -233,10 +703,78 @@ namespace {
             std::unique_ptr<ExprAST> Start,
             std::unique_ptr<ExprAST> End,
             std::unique_ptr<ExprAST> Step,
-            std::unique_ptr<ExprAST> Body)
-            : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Body(std::move(Body)) {}
+            std::unique_ptr<ExprAST> Body,
+            LoopHints Hints = LoopHints())
+            : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)),
+              Body(std::move(Body)), Hints(Hints) {}
+
+    Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override {
+      ++Shape.Nodes;
+      Shape.HasLoop = true;
+      Start->measure(Shape);
+      End->measure(Shape);
+      if (Step) {
+        Step->measure(Shape);
+      }
+      Body->measure(Shape);
+    }
+
+    // the loop variable is in scope everywhere but in Start
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += "f(";
+      Start->addToKey(Key);
+      Key.Scope.push_back(VarName);
+      Body->addToKey(Key);
+      Key.Key += "s";
+      if (Step) {
+        Step->addToKey(Key);
+      }
+      End->addToKey(Key);
+      Key.Scope.pop_back();
+      Key.Key += ")";
+      if (!Hints.empty()) {
+        Key.Key += "u" + std::to_string(Hints.Unroll) + "v" + std::to_string(Hints.Vectorize) + "i" +
+                   std::to_string(Hints.Interleave) + ";";
+      }
+    }
+  };
+
+  // WhileExprAST - Expression class for "while/do"; the condition is tested
+  // before every iteration
+  class WhileExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Cond, Body;
+
+  public:
+    WhileExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Body)
+            : Cond(std::move(Cond)), Body(std::move(Body)) {}
+
+    Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override {
+      ++Shape.Nodes;
+      Shape.HasLoop = true;
+      Cond->measure(Shape);
+      Body->measure(Shape);
+    }
 
+    void addToKey(StructuralKey &Key) const override {
+      Key.Key += "w(";
+      Cond->addToKey(Key);
+      Body->addToKey(Key);
+      Key.Key += ")";
+    }
+  };
+
+  // BreakExprAST - leaves the innermost for or while loop
+  class BreakExprAST : public ExprAST {
+  public:
     Value *codegen() override;
+
+    void measure(ASTShape &Shape) const override { ++Shape.Nodes; }
+
+    void addToKey(StructuralKey &Key) const override { Key.Key += "k;"; }
   };
 
 // PrototypeAST - represents the "prototype" for the function
@@ -253,6 +791,10 @@ namespace {
 
     const std::string &getName() const { return Name; }
 
+    size_t getArity() const { return Args.size(); }
+
+    const std::vector<std::string> &getArgs() const { return Args; }
+
     Function *codegen();
   };
 
@@ -266,6 +808,40 @@ namespace {
             : Proto(std::move(proto)), Body(std::move(body)) {}
 
     Function *codegen();
+
+    const PrototypeAST &getProto() const { return *Proto; }
+
+    ASTShape measure() const {
+      ASTShape Shape;
+      Body->measure(Shape);
+      return Shape;
+    }
+
+    // getStructuralHash - equal for bodies that are identical up to the names
+    // of the function and its parameters and loop variables. The functions
+    // the body calls are added to Callees, and the constants it reads to
+    // Globals, if given.
+    StructuralHash getStructuralHash(std::set<std::string> *Callees = nullptr,
+                                     std::set<std::string> *Globals = nullptr) const {
+      StructuralKey Key;
+      Key.Self = &Proto->getName();
+      Key.Scope = Proto->getArgs();
+      Key.Key = std::to_string(Key.Scope.size()) + ":";
+      Body->addToKey(Key);
+      // constants are compiled in, so their current values are part of the body
+      for (auto &Name: Key.Globals) {
+        if (const double *Value = findConstant(Name)) {
+          Key.Key += "=" + Name + ":" + utohexstr(DoubleToBits(*Value)) + ";";
+        }
+      }
+      if (Callees) {
+        *Callees = std::move(Key.Callees);
+      }
+      if (Globals) {
+        *Globals = std::move(Key.Globals);
+      }
+      return BLAKE3::hash<16>(arrayRefFromStringRef(Key.Key));
+    }
   };
 }
 
@@ -285,6 +861,13 @@ static std::map<char, int> BinopPrecedence;
 
 // GetTokPrecedence
 static int GetTokPrecedence() {
+  // both bind looser than comparisons, '&&' tighter than '||'
+  if (CurTok == tok_or) {
+    return 4;
+  }
+  if (CurTok == tok_and) {
+    return 6;
+  }
   if (!isascii(CurTok)) {
     return -1;
   }
@@ -310,6 +893,7 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
  * 2.4 Basic Expression Parsing
  */
 static std::unique_ptr<ExprAST> ParseExpression();
+static std::unique_ptr<ExprAST> ParsePrimary();
 
 // numberexpr :: number
 // This function is to be called when current token is a tok_number
@@ -371,6 +955,10 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 
   // Eat the ')'.
   getNextToken();
+  // likely(cond) and unlikely(cond) are hints, not calls
+  if ((IdName == "likely" || IdName == "unlikely") && Args.size() == 1) {
+    return std::make_unique<BranchHintExprAST>(IdName == "likely", std::move(Args[0]));
+  }
   return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
@@ -406,10 +994,12 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
   return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
 }
 
-// forexpr::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+// forexpr::= 'for' identifier '=' expr ',' expr (',' expr)? loophint* 'in' expression
+// loophint ::= ('unroll' | 'vectorize' | 'interleave') number
 // example: for i = 1, i < n, 1.0 in ...
 // Also, 'Step' can be omitted, and the default value is 1.0, so the above example can also be:
-// for i = 1, i < n, in ...
+// for i = 1, i < n in ...
+// example with hints: for i = 0, i < n, 1 unroll 4 vectorize 8 in ...
 static std::unique_ptr<ExprAST> ParseForExpr() {
   getNextToken(); // eat "for"
   if (CurTok != tok_identifier) {
@@ -447,6 +1037,24 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     }
   }
 
+  // hints are plain identifiers, so they stay usable as names elsewhere
+  LoopHints Hints;
+  while (CurTok == tok_identifier) {
+    unsigned *Hint = IdentifierStr == "unroll" ? &Hints.Unroll
+                     : IdentifierStr == "vectorize" ? &Hints.Vectorize
+                     : IdentifierStr == "interleave" ? &Hints.Interleave
+                     : nullptr;
+    if (!Hint) {
+      return LogError("expected unroll, vectorize, interleave or 'in' in for");
+    }
+    getNextToken(); // eat the hint
+    if (CurTok != tok_number || NumVal < 1 || NumVal != (unsigned) NumVal) {
+      return LogError("expected a positive integer after a loop hint");
+    }
+    *Hint = (unsigned) NumVal;
+    getNextToken(); // eat the number
+  }
+
   if (CurTok != tok_in) {
     return LogError("expected 'in' after for");
   }
@@ -457,7 +1065,43 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     return nullptr;
   }
   return std::make_unique<ForExprAST>(
-          IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
+          IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body), Hints);
+}
+
+// whileexpr ::= 'while' expression 'do' expression
+// example: while more(x) do step(x)
+static std::unique_ptr<ExprAST> ParseWhileExpr() {
+  getNextToken(); // eat "while"
+  auto Cond = ParseExpression();
+  if (!Cond) {
+    return nullptr;
+  }
+  if (CurTok != tok_do) {
+    return LogError("expected 'do' after while");
+  }
+  getNextToken(); // eat "do"
+
+  auto Body = ParseExpression();
+  if (!Body) {
+    return nullptr;
+  }
+  return std::make_unique<WhileExprAST>(std::move(Cond), std::move(Body));
+}
+
+// breakexpr ::= 'break'
+static std::unique_ptr<ExprAST> ParseBreakExpr() {
+  getNextToken(); // eat "break"
+  return std::make_unique<BreakExprAST>();
+}
+
+// notexpr ::= '!' primary
+static std::unique_ptr<ExprAST> ParseNotExpr() {
+  getNextToken(); // eat '!'
+  auto Operand = ParsePrimary();
+  if (!Operand) {
+    return nullptr;
+  }
+  return std::make_unique<NotExprAST>(std::move(Operand));
 }
 
 /**
@@ -467,6 +1111,9 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
  *      ::= parenexpr
  *      ::= ifexpr
  *      ::= forexpr
+ *      ::= whileexpr
+ *      ::= breakexpr
+ *      ::= notexpr
  */
 static std::unique_ptr<ExprAST> ParsePrimary() {
   switch (CurTok) {
@@ -482,6 +1129,12 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
       return ParseIfExpr();
     case tok_for:
       return ParseForExpr();
+    case tok_while:
+      return ParseWhileExpr();
+    case tok_break:
+      return ParseBreakExpr();
+    case '!':
+      return ParseNotExpr();
   }
 }
 
@@ -512,7 +1165,11 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
         return nullptr;
       }
     }
-    LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    if (BinOp == tok_and || BinOp == tok_or) {
+      LHS = std::make_unique<LogicalExprAST>(BinOp == tok_and, std::move(LHS), std::move(RHS));
+    } else {
+      LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    }
   }
 }
 
@@ -581,6 +1238,21 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
   return ParsePrototype();
 }
 
+// const ::= 'const' identifier '=' expression
+static std::unique_ptr<ExprAST> ParseConst(std::string &Name) {
+  getNextToken(); // eat const
+  if (CurTok != tok_identifier) {
+    return LogError("expected identifier after const");
+  }
+  Name = IdentifierStr;
+  getNextToken(); // eat the identifier
+  if (CurTok != '=') {
+    return LogError("expected '=' after const name");
+  }
+  getNextToken(); // eat '='
+  return ParseExpression();
+}
+
 
 /**
  * Code Generation
@@ -597,16 +1269,50 @@ static std::unique_ptr<IRBuilder<>> Builder;
 // keeps track of which values are defined in the current scope and what their
 // LLVM representation is
 static std::map<std::string, Value *> NamedValues;
+// values of const and frozen globals, which are compiled in as constants
+static std::map<std::string, double> ConstantValues;
+// names whose value is set by the host
+static std::set<std::string> FrozenNames;
+
+static const double *findConstant(const std::string &Name) {
+  auto I = ConstantValues.find(Name);
+  return I == ConstantValues.end() ? nullptr : &I->second;
+}
+// Hash-consing of pure expressions: the value of every binary expression
+// emitted so far in the current function, keyed by its operator and operand
+// values. Identical subtrees then get identical operands bottom-up, so each
+// one is emitted once however often it is repeated. Code in an if arm or a
+// loop body does not dominate what follows it, so those get their own scope.
+using ExprKey = std::tuple<char, Value *, Value *>;
+static std::vector<DenseMap<ExprKey, Value *>> ExprScopes(1);
+
+struct ExprScope {
+  ExprScope() { ExprScopes.emplace_back(); }
+
+  ~ExprScope() { ExprScopes.pop_back(); }
+};
+
+// exit blocks of the loops being emitted, innermost last, for 'break'
+static std::vector<BasicBlock *> BreakTargets;
 
 static std::unique_ptr<KaleidoscopeJIT> TheJIT;
+// only used when emitting an object file, see EmitObjectFile()
+static std::unique_ptr<TargetMachine> TheTargetMachine;
 static std::unique_ptr<FunctionPassManager> TheFPM;
+// built on first use, see getFunctionPipeline()
+static std::unique_ptr<FunctionPassManager> TheLightFPM;
+static std::unique_ptr<FunctionPassManager> TheAggressiveFPM;
+static std::unique_ptr<FunctionPassManager> TheLoopHintFPM;
 static std::unique_ptr<LoopAnalysisManager> TheLAM;
 static std::unique_ptr<FunctionAnalysisManager> TheFAM;
 static std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
 static std::unique_ptr<ModuleAnalysisManager> TheMAM;
 static std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
 static std::unique_ptr<StandardInstrumentations> TheSI;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+// Signatures of everything defined or declared so far, see SignatureRegistry.h.
+// Every call site consults it, so lookups do not lock.
+static SignatureRegistry FunctionSignatures;
 static ExitOnError ExitOnErr;
 
 
@@ -621,10 +1327,13 @@ Function *getFunction(std::string Name) {
     return F;
   }
 
-  // If not, check whether we can codegen the declaration from some existing prototype
-  auto FI = FunctionProtos.find(Name);
-  if (FI != FunctionProtos.end()) {
-    return FI->second->codegen();
+  // If not, check whether we can codegen the declaration from some existing signature
+  if (auto Sig = FunctionSignatures.lookup(Name)) {
+    std::vector<Type *> Doubles(Sig->Arity, Type::getDoubleTy(*TheContext));
+    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+    F->setCallingConv(Sig->CC);
+    return F;
   }
   // If no existing prototype exists, return null
   return nullptr;
@@ -637,19 +1346,88 @@ Value *NumberExprAST::codegen() {
 
 Value *VariableExprAST::codegen() {
   // Look this variable up in the function
-  Value *V = NamedValues[Name];
-  if (!V) {
-    return LogErrorV("Unknown variable name");
+  auto V = NamedValues.find(Name);
+  if (V != NamedValues.end() && V->second) {
+    return V->second;
   }
-  return V;
+  // then among the constants, whose value is folded into the code
+  if (const double *C = findConstant(Name)) {
+    return ConstantFP::get(*TheContext, APFloat(*C));
+  }
+  return LogErrorV("Unknown variable name");
 }
 
-Value *BinaryExprAST::codegen() {
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
-  if (!L || !R) {
+// emitSafepointPoll - with -safepoints, call the runtime's __ks_safepoint when
+// __ks_poll is set. The fast path is one relaxed load and a branch that is
+// predicted not taken.
+static void emitSafepointPoll() {
+  if (!Safepoints) {
+    return;
+  }
+  auto *Int32Ty = Type::getInt32Ty(*TheContext);
+  Constant *PollWord = TheModule->getOrInsertGlobal("__ks_poll", Int32Ty);
+  FunctionCallee Safepoint = TheModule->getOrInsertFunction("__ks_safepoint", Type::getVoidTy(*TheContext));
+
+  LoadInst *Poll = Builder->CreateAlignedLoad(Int32Ty, PollWord, Align(4), "poll");
+  Poll->setAtomic(AtomicOrdering::Monotonic);
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *SlowBB = BasicBlock::Create(*TheContext, "safepoint", TheFunction);
+  BasicBlock *ContBB = BasicBlock::Create(*TheContext, "safepoint.cont", TheFunction);
+  Builder->CreateCondBr(Builder->CreateICmpNE(Poll, ConstantInt::get(Int32Ty, 0)), SlowBB, ContBB,
+                        MDBuilder(*TheContext).createBranchWeights(1, 1 << 20));
+
+  Builder->SetInsertPoint(SlowBB);
+  Builder->CreateCall(Safepoint);
+  Builder->CreateBr(ContBB);
+  Builder->SetInsertPoint(ContBB);
+}
+
+// getBranchWeights - !prof for a branch that is taken when Cond is true, from
+// a likely()/unlikely() hint; nullptr without one. 2000:1 is what Clang uses
+// for __builtin_expect.
+static MDNode *getBranchWeights(const ExprAST &Cond) {
+  switch (Cond.getBranchHint()) {
+    case 1:
+      return MDBuilder(*TheContext).createBranchWeights(2000, 1);
+    case -1:
+      return MDBuilder(*TheContext).createBranchWeights(1, 2000);
+    default:
+      return nullptr;
+  }
+}
+
+// getLoopMetadata - the llvm.loop node for the back-edge of a loop with hints:
+// a distinct node whose first operand is itself, followed by the hints
+static MDNode *getLoopMetadata(const LoopHints &Hints) {
+  if (Hints.empty()) {
     return nullptr;
   }
+  auto *Int32Ty = Type::getInt32Ty(*TheContext);
+  auto Hint = [&](const char *Name, unsigned Value) -> Metadata * {
+    return MDNode::get(*TheContext, {MDString::get(*TheContext, Name),
+                                     ConstantAsMetadata::get(ConstantInt::get(Int32Ty, Value))});
+  };
+  SmallVector<Metadata *, 5> Ops = {nullptr};
+  if (Hints.Unroll == 1) {
+    Ops.push_back(MDNode::get(*TheContext, MDString::get(*TheContext, "llvm.loop.unroll.disable")));
+  } else if (Hints.Unroll) {
+    Ops.push_back(Hint("llvm.loop.unroll.count", Hints.Unroll));
+  }
+  if (Hints.Vectorize) {
+    Ops.push_back(Hint("llvm.loop.vectorize.width", Hints.Vectorize));
+    Ops.push_back(MDNode::get(*TheContext, {MDString::get(*TheContext, "llvm.loop.vectorize.enable"),
+                                            ConstantAsMetadata::get(ConstantInt::getBool(*TheContext,
+                                                                                         Hints.Vectorize > 1))}));
+  }
+  if (Hints.Interleave) {
+    Ops.push_back(Hint("llvm.loop.interleave.count", Hints.Interleave));
+  }
+  MDNode *LoopID = MDNode::getDistinct(*TheContext, Ops);
+  LoopID->replaceOperandWith(0, LoopID);
+  return LoopID;
+}
+
+static Value *emitBinary(char Op, Value *L, Value *R) {
   switch (Op) {
     case '+':
       return Builder->CreateFAdd(L, R, "addtmp");
@@ -666,6 +1444,26 @@ Value *BinaryExprAST::codegen() {
   }
 }
 
+Value *BinaryExprAST::codegen() {
+  Value *L = LHS->codegen();
+  Value *R = RHS->codegen();
+  if (!L || !R) {
+    return nullptr;
+  }
+  // fadd and fmul are commutative, so a+b and b+a share one entry
+  ExprKey Key = (Op == '+' || Op == '*') && R < L ? ExprKey(Op, R, L) : ExprKey(Op, L, R);
+  for (auto Scope = ExprScopes.rbegin(); Scope != ExprScopes.rend(); ++Scope) {
+    if (Value *V = Scope->lookup(Key)) {
+      return V;
+    }
+  }
+  Value *V = emitBinary(Op, L, R);
+  if (V) {
+    ExprScopes.back()[Key] = V;
+  }
+  return V;
+}
+
 // it looks like `sin(x)`
 Value *CallExprAST::codegen() {
   // originally `TheModule->getFunction`
@@ -708,14 +1506,163 @@ Function *PrototypeAST::codegen() {
   return F;
 }
 
+static void recordSignature(const PrototypeAST &P) {
+  FunctionSignatures.set(P.getName(), {static_cast<unsigned>(P.getArity()), CallingConv::C});
+}
+
+/**
+ * Adaptive optimization
+ *
+ * One-shot anonymous expressions and long-lived library functions do not
+ * deserve the same pipeline. The level is picked from cheap signals: the
+ * size of the body, whether it has loops, whether it is an anonymous
+ * expression and how often the name was called before it was redefined.
+ * Functions that become hot later are recompiled by the JIT with the
+ * aggressive pipeline and their profile. Once the total optimization time
+ * exceeds -opt-budget-ms, new functions only get the light pipeline;
+ * redefinitions of busy functions and hot recompilation are not limited by
+ * the budget.
+ */
+enum class OptLevel { None, Light, Standard, Aggressive };
+
+static const char *getOptLevelName(OptLevel L) {
+  switch (L) {
+    case OptLevel::None:
+      return "none";
+    case OptLevel::Light:
+      return "light";
+    case OptLevel::Standard:
+      return "standard";
+    case OptLevel::Aggressive:
+      return "aggressive";
+  }
+  llvm_unreachable("unknown optimization level");
+}
+
+static double OptMillisSpent = 0;
+
+// calls to the previous bodies of a name after which its redefinition is
+// optimized aggressively
+static const uint64_t BusyCallCount = 1000;
+
+static OptLevel chooseOptLevel(const std::string &Name, const ASTShape &Shape) {
+  if (Name != "__anon_expr" && TheJIT && TheJIT->getCallCount(Name) >= BusyCallCount) {
+    // the code calling it is still running the old body: worth the full pipeline
+    return OptLevel::Aggressive;
+  }
+  OptLevel L;
+  if (Name == "__anon_expr") {
+    // runs exactly once: only a loop can make optimizing it worthwhile
+    L = Shape.HasLoop ? OptLevel::Standard : OptLevel::None;
+  } else if (Shape.HasLoop) {
+    L = OptLevel::Aggressive;
+  } else if (Shape.Nodes <= 8) {
+    L = OptLevel::Light;
+  } else {
+    L = OptLevel::Standard;
+  }
+  if (OptBudgetMs && OptMillisSpent >= OptBudgetMs) {
+    L = std::min(L, OptLevel::Light);
+  }
+  return L;
+}
+
+static FunctionPassManager *getFunctionPipeline(OptLevel L) {
+  switch (L) {
+    case OptLevel::None:
+      return nullptr;
+    case OptLevel::Light:
+      if (!TheLightFPM) {
+        TheLightFPM = std::make_unique<FunctionPassManager>();
+        TheLightFPM->addPass(InstCombinePass());
+        TheLightFPM->addPass(SimplifyCFGPass());
+      }
+      return TheLightFPM.get();
+    case OptLevel::Standard:
+      return TheFPM.get();
+    case OptLevel::Aggressive:
+      if (!TheAggressiveFPM) {
+        PassBuilder PB;
+        TheAggressiveFPM = std::make_unique<FunctionPassManager>(
+                PB.buildFunctionSimplificationPipeline(OptimizationLevel::O2, ThinOrFullLTOPhase::None));
+      }
+      return TheAggressiveFPM.get();
+  }
+  llvm_unreachable("unknown optimization level");
+}
+
+// hasLoopHints - whether a loop of F was annotated with unroll, vectorize or
+// interleave hints
+static bool hasLoopHints(const Function &F) {
+  for (auto &BB: F) {
+    if (auto *Term = BB.getTerminator(); Term && Term->getMetadata(LLVMContext::MD_loop)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The function simplification pipelines do not vectorize or partially unroll
+// loops, so annotated loops get the passes that read their hints.
+static void addLoopHintPasses(FunctionPassManager &FPM) {
+  FPM.addPass(LoopVectorizePass());
+  FPM.addPass(LoopUnrollPass(LoopUnrollOptions(2)));
+  FPM.addPass(InstCombinePass());
+  FPM.addPass(SimplifyCFGPass());
+}
+
+// optimizeAggressively - the pipeline for functions that proved hot, used by
+// the JIT when it recompiles them with their profile
+static void optimizeAggressively(Function &F) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  auto FPM = PB.buildFunctionSimplificationPipeline(OptimizationLevel::O2, ThinOrFullLTOPhase::None);
+  if (hasLoopHints(F)) {
+    addLoopHintPasses(FPM);
+  }
+  FPM.run(F, FAM);
+}
+
+static void optimizeFunction(Function &F, const FunctionAST &FnAST) {
+  ASTShape Shape = FnAST.measure();
+  OptLevel L = chooseOptLevel(F.getName().str(), Shape);
+  auto Start = std::chrono::steady_clock::now();
+  if (FunctionPassManager *FPM = getFunctionPipeline(L)) {
+    FPM->run(F, *TheFAM);
+  }
+  if (L != OptLevel::None && hasLoopHints(F)) {
+    if (!TheLoopHintFPM) {
+      TheLoopHintFPM = std::make_unique<FunctionPassManager>();
+      addLoopHintPasses(*TheLoopHintFPM);
+    }
+    TheLoopHintFPM->run(F, *TheFAM);
+  }
+  double Ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+  OptMillisSpent += Ms;
+  if (OptStats) {
+    fprintf(stderr, "[opt] %-24s nodes=%-5u loops=%d %-10s %8.3f ms (total %.3f ms)\n",
+            F.getName().str().c_str(), Shape.Nodes, Shape.HasLoop, getOptLevelName(L), Ms, OptMillisSpent);
+  }
+}
+
 // function code generation: a real function including body
 Function *FunctionAST::codegen() {
-  // First, check for an existing function from a previous extern declaration
+  // Remember the signature so later modules can declare this function, then
+  // emit the prototype with its argument names (a declaration made from the
+  // signature alone would leave the arguments unnamed)
   auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
-  Function *TheFunction = getFunction(P.getName());
+  recordSignature(P);
+  Function *TheFunction = TheModule->getFunction(P.getName());
   if (!TheFunction) {
-    TheFunction = Proto->codegen();
+    TheFunction = P.codegen();
   }
   if (!TheFunction) {
     return nullptr;
@@ -728,17 +1675,20 @@ Function *FunctionAST::codegen() {
   Builder->SetInsertPoint(BB);
   // Record the function arguments in the NamedValues map
   NamedValues.clear();
+  ExprScopes.back().clear();
   for (auto &Arg: TheFunction->args()) {
     NamedValues[std::string(Arg.getName())] = &Arg;
   }
+  // deep recursion is stopped at function entry, loops at their back-edge
+  emitSafepointPoll();
   if (Value *RetVal = Body->codegen()) {
     // Finish off the function
     Builder->CreateRet(RetVal);
     // Validate the generated code, checking for consistency
     verifyFunction(*TheFunction);
 
-    // Run the optimizer on the function
-    TheFPM->run(*TheFunction, *TheFAM);
+    // Run the optimizer on the function, as hard as it is likely to pay off
+    optimizeFunction(*TheFunction, *this);
 
     return TheFunction;
   }
@@ -763,13 +1713,18 @@ Value *IfExprAST::codegen() {
   BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
   BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-  Builder->CreateCondBr(CondV, ThenBB, ElseBB); // create a conditional 'br Cond TrueDest, FalseDest'
+  // create a conditional 'br Cond TrueDest, FalseDest'
+  Builder->CreateCondBr(CondV, ThenBB, ElseBB, getBranchWeights(*Cond));
 
   // Emit then value
   Builder->SetInsertPoint(ThenBB); // created instruction appended to the end of the ThenBB
   // but because currently 'ThenBB' is empty, so `CreateBr` will insert the BB to the start and end of the block
 
-  Value *ThenV = Then->codegen();
+  Value *ThenV;
+  {
+    ExprScope ThenScope;
+    ThenV = Then->codegen();
+  }
   if (!ThenV) {
     return nullptr;
   }
@@ -782,7 +1737,11 @@ Value *IfExprAST::codegen() {
   TheFunction->insert(TheFunction->end(), ElseBB);
   Builder->SetInsertPoint(ElseBB);
 
-  Value *ElseV = Else->codegen();
+  Value *ElseV;
+  {
+    ExprScope ElseScope;
+    ElseV = Else->codegen();
+  }
   if (!ElseV) {
     return nullptr;
   }
@@ -804,41 +1763,107 @@ Value *IfExprAST::codegen() {
 }
 
 /**
- * IR looks like:
+ * IR of 'a && b' looks like ('a || b' swaps the successors and yields 1.0):
  *
  * entry:
- *  br label %loop
+ *  ; a
+ *  br %i1 lhscond, label %logic.rhs, label %logic.end
  *
- * loop:
- *  phi instruction [, %entry], [, %loop]
- *  ; body
- *  ...
- *  ; increment
- *  ...
- *  ; termination test
- *  ...
- *  br %i1 loopcond, label %loop, label %afterloop
+ * logic.rhs:
+ *  ; b
+ *  br label %logic.end
  *
- * afterloop:
- *  ret double 0.000
+ * logic.end:
+ *  phi double [0.0, %entry], [b != 0, %logic.rhs]
  */
-Value *ForExprAST::codegen() {
-  // Emit the start code first, without 'variable' in scope
-  Value *StartVal = Start->codegen();
-  if (!StartVal) {
+Value *LogicalExprAST::codegen() {
+  Value *L = LHS->codegen();
+  if (!L) {
     return nullptr;
   }
+  Value *Zero = ConstantFP::get(*TheContext, APFloat(0.0));
+  Value *LCond = Builder->CreateFCmpONE(L, Zero, "lhscond");
 
-  // Make the new basic block for the loop header, inserting after current block.
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
-  BasicBlock *PreheaderBB = Builder->GetInsertBlock(); // the entry block
+  BasicBlock *LHSBB = Builder->GetInsertBlock();
+  BasicBlock *RHSBB = BasicBlock::Create(*TheContext, "logic.rhs", TheFunction);
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "logic.end");
+  if (IsAnd) {
+    Builder->CreateCondBr(LCond, RHSBB, MergeBB, getBranchWeights(*LHS));
+  } else {
+    Builder->CreateCondBr(LCond, MergeBB, RHSBB, getBranchWeights(*LHS));
+  }
 
-  // Insert an explict  fall through from the current block
-  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+  Builder->SetInsertPoint(RHSBB);
+  Value *R;
+  {
+    // the right operand does not dominate what follows
+    ExprScope RHSScope;
+    R = RHS->codegen();
+  }
+  if (!R) {
+    return nullptr;
+  }
+  R = Builder->CreateUIToFP(Builder->CreateFCmpONE(R, Zero, "rhscond"), Type::getDoubleTy(*TheContext), "rhsbool");
+  Builder->CreateBr(MergeBB);
+  // codegen of RHS can change the current block, update RHSBB for the PHI
+  RHSBB = Builder->GetInsertBlock();
+
+  TheFunction->insert(TheFunction->end(), MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, IsAnd ? "andtmp" : "ortmp");
+  PN->addIncoming(ConstantFP::get(*TheContext, APFloat(IsAnd ? 0.0 : 1.0)), LHSBB);
+  PN->addIncoming(R, RHSBB);
+  return PN;
+}
+
+Value *NotExprAST::codegen() {
+  Value *V = Operand->codegen();
+  if (!V) {
+    return nullptr;
+  }
+  V = Builder->CreateFCmpOEQ(V, ConstantFP::get(*TheContext, APFloat(0.0)), "nottmp");
+  return Builder->CreateUIToFP(V, Type::getDoubleTy(*TheContext), "booltmp");
+}
+
+/**
+ * IR looks like:
+ *
+ * entry:
+ *  br label %loop
+ *
+ * loop:
+ *  phi instruction [, %entry], [, %loop]
+ *  ; body
+ *  ...
+ *  ; increment
+ *  ...
+ *  ; termination test
+ *  ...
+ *  br %i1 loopcond, label %loop, label %afterloop
+ *
+ * afterloop:
+ *  ret double 0.000
+ */
+Value *ForExprAST::codegen() {
+  // Emit the start code first, without 'variable' in scope
+  Value *StartVal = Start->codegen();
+  if (!StartVal) {
+    return nullptr;
+  }
+
+  // Make the new basic block for the loop header, inserting after current block.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = Builder->GetInsertBlock(); // the entry block
+
+  // Insert an explict  fall through from the current block
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
   Builder->CreateBr(LoopBB); // br instruction
 
   // Start insertion in LoopBB
   Builder->SetInsertPoint(LoopBB);
+  // the exit block, known now so that break can branch to it
+  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop");
   // Start the PHI node with an entry for start
   PHINode *Variable = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, VarName);
   Variable->addIncoming(StartVal, PreheaderBB); // [startVal, entry]
@@ -847,12 +1872,25 @@ Value *ForExprAST::codegen() {
   // If it shadows an existing variable, we have to restore it, so save it now.
   Value *OldVal = NamedValues[VarName];
   NamedValues[VarName] = Variable;
+  // values computed in the loop are only reused in the loop
+  ExprScope LoopScope;
+
+  // break in the body, the step or the end condition leaves this loop. On an
+  // error the exit block, which a break may already branch to, is handed to
+  // the function, which is erased with it.
+  BreakTargets.push_back(AfterBB);
+  auto Fail = [&]() -> Value * {
+    BreakTargets.pop_back();
+    TheFunction->insert(TheFunction->end(), AfterBB);
+    return nullptr;
+  };
 
   // Emit the body of the loop.
   // This, like any other expr, can change the current BB.
   // Note that we ignore the value computed by the body, but don't allow an error
-  if (!Body->codegen()) {
-    return nullptr;
+  Value *BodyV = Body->codegen();
+  if (!BodyV) {
+    return Fail();
   }
 
   // Emit the step value
@@ -860,7 +1898,7 @@ Value *ForExprAST::codegen() {
   if (Step) {
     StepVal = Step->codegen();
     if (!StepVal) {
-      return nullptr;
+      return Fail();
     }
   } else {
     // if not specified, use 1.0
@@ -871,18 +1909,23 @@ Value *ForExprAST::codegen() {
   // Compute the end condition
   Value *EndCond = End->codegen();
   if (!EndCond) {
-    return nullptr;
+    return Fail();
   }
+  BreakTargets.pop_back();
   // Convert condition to a bool by comparing non-equal to 0.0
   EndCond = Builder->CreateFCmpONE(EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+  emitSafepointPoll();
 
   // Evalute the exit value of the loop
-  // Create the "after loop" block and insert it
+  // Insert the "after loop" block
   BasicBlock *LoopEndBB = Builder->GetInsertBlock();
-  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+  TheFunction->insert(TheFunction->end(), AfterBB);
 
   // Insert the conditional branch into the end of LoopEndBB
-  Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  BranchInst *BackEdge = Builder->CreateCondBr(EndCond, LoopBB, AfterBB, getBranchWeights(*End));
+  if (MDNode *LoopID = getLoopMetadata(Hints)) {
+    BackEdge->setMetadata(LLVMContext::MD_loop, LoopID);
+  }
   // Any new code will be inserted in AfterBB
   Builder->SetInsertPoint(AfterBB);
 
@@ -899,23 +1942,106 @@ Value *ForExprAST::codegen() {
   return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
+/**
+ * IR looks like:
+ *
+ * entry:
+ *  br label %while.cond
+ *
+ * while.cond:
+ *  ; condition
+ *  br %i1 whilecond, label %while.body, label %while.end
+ *
+ * while.body:
+ *  ; body, 'break' branches to %while.end
+ *  br label %while.cond
+ *
+ * while.end:
+ */
+Value *WhileExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *CondBB = BasicBlock::Create(*TheContext, "while.cond", TheFunction);
+  BasicBlock *BodyBB = BasicBlock::Create(*TheContext, "while.body");
+  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "while.end");
+  Builder->CreateBr(CondBB);
+
+  Builder->SetInsertPoint(CondBB);
+  // values computed in the loop are only reused in the loop
+  ExprScope LoopScope;
+  // break in the condition or the body leaves this loop; on an error the
+  // blocks not inserted yet are handed to the function, which is erased
+  BreakTargets.push_back(AfterBB);
+  auto Fail = [&]() -> Value * {
+    BreakTargets.pop_back();
+    if (!BodyBB->getParent()) {
+      TheFunction->insert(TheFunction->end(), BodyBB);
+    }
+    TheFunction->insert(TheFunction->end(), AfterBB);
+    return nullptr;
+  };
+  Value *CondV = Cond->codegen();
+  if (!CondV) {
+    return Fail();
+  }
+  CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "whilecond");
+  Builder->CreateCondBr(CondV, BodyBB, AfterBB, getBranchWeights(*Cond));
+
+  TheFunction->insert(TheFunction->end(), BodyBB);
+  Builder->SetInsertPoint(BodyBB);
+  Value *BodyV = Body->codegen();
+  if (!BodyV) {
+    return Fail();
+  }
+  BreakTargets.pop_back();
+  emitSafepointPoll();
+  Builder->CreateBr(CondBB);
+
+  TheFunction->insert(TheFunction->end(), AfterBB);
+  Builder->SetInsertPoint(AfterBB);
+  // while expr always returns 0.0
+  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+}
+
+Value *BreakExprAST::codegen() {
+  if (BreakTargets.empty()) {
+    return LogErrorV("break outside of a loop");
+  }
+  Builder->CreateBr(BreakTargets.back());
+  // whatever follows the break in the same expression is unreachable, give it
+  // a block of its own
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "afterbreak", TheFunction));
+  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+}
+
 
 /**
  * Top Level parsing and JIT Driver
  */
 
+static void InitializePassManagers();
+
 static void InitializeModuleAndPassManagers() {
   // Open a new context and module
   TheContext = std::make_unique<LLVMContext>();
   TheModule = std::make_unique<Module>("KaleidoscopeJIT", *TheContext);
-  TheModule->setDataLayout(TheJIT->getDataLayout());
+  TheModule->setDataLayout(TheJIT ? TheJIT->getDataLayout() : TheTargetMachine->createDataLayout());
+  if (TheTargetMachine) {
+    // the function passes ahead of time already see the target
+    TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+  }
 
   // Create a new builder for the module
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
 
-  // Create new pass and analysis managers
-  TheFPM = std::make_unique<FunctionPassManager>();
+  InitializePassManagers();
+}
 
+// InitializePassManagers - pass and analysis managers for TheContext
+static void InitializePassManagers() {
+  // Create new analysis managers: their cached results refer to the IR of the
+  // previous context. The pass pipelines hold no IR and are kept across
+  // modules, the standard one is built here once and the others on first use.
   // 4 analysis managers allow us to add analysis passes
   // that run across the four levels of the IR hierarchy
   TheLAM = std::make_unique<LoopAnalysisManager>();
@@ -933,21 +2059,26 @@ static void InitializeModuleAndPassManagers() {
 
   TheSI->registerCallbacks(*ThePIC, TheMAM.get());
 
-  // Add transform pass
-  // do simple peehole optimizations and bit-twiddling optzns
-  // do pattern matching and simplify
-  TheFPM->addPass(InstCombinePass());
-  // Reassociate expressions: a * b = b * a
-  TheFPM->addPass(ReassociatePass());
-  // Eliminate Common subexpressions: Global Value Numbering(GVN)
-  TheFPM->addPass(GVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc)
-  TheFPM->addPass(SimplifyCFGPass());
+  if (!TheFPM) {
+    TheFPM = std::make_unique<FunctionPassManager>();
+    // Add transform pass
+    // do simple peehole optimizations and bit-twiddling optzns
+    // do pattern matching and simplify
+    TheFPM->addPass(InstCombinePass());
+    // Reassociate expressions: a * b = b * a
+    TheFPM->addPass(ReassociatePass());
+    // Eliminate Common subexpressions: Global Value Numbering(GVN)
+    TheFPM->addPass(GVNPass());
+    // Simplify the control flow graph (deleting unreachable blocks, etc)
+    TheFPM->addPass(SimplifyCFGPass());
+  }
 
   // Register analysis passes used in these transform pass
   PassBuilder PB;
   PB.registerModuleAnalyses(*TheMAM);
+  PB.registerCGSCCAnalyses(*TheCGAM);
   PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
   PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
 }
 
@@ -961,15 +2092,269 @@ static void InitializeModule() {
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
 }
 
+// the first definition of each distinct body, by structural hash; later
+// definitions with the same body become aliases of it. Names are interned in
+// FunctionSignatures, so -stream keeps no string per body.
+static std::map<StructuralHash, const SignatureRegistry::Symbol *> DefinitionsByHash;
+
+// definitions waiting to be compiled together in streaming mode
+static std::vector<std::string> PendingCompiles;
+
+static void flushPendingCompiles() {
+  if (!PendingCompiles.empty()) {
+    ExitOnErr(TheJIT->compileAllNow(PendingCompiles));
+    PendingCompiles.clear();
+  }
+}
+
+/**
+ * Incremental recompilation
+ *
+ * A name can be defined again, e.g. when a script is reloaded by -watch. The
+ * new body is compared with the current one by structural hash: an unchanged
+ * definition is skipped, a changed one replaces the body behind the stub, so
+ * callers pick it up without being recompiled (definitions never inline each
+ * other in the JIT). Callers only have to be redefined when the number of
+ * arguments changes: the dependency graph below finds them, and their bodies
+ * are replaced by one that reports the stale call, until they are redefined.
+ *
+ * -stream keeps none of this per definition, only the hashes of distinct
+ * bodies: a redefinition is always compiled, callers are not checked, and an
+ * alias whose target changes is disarmed, as it has no AST of its own.
+ */
+
+// hash of the current definition of each name
+static std::map<std::string, StructuralHash> DefinitionHashes;
+// callee -> definitions that call it, and the reverse
+static std::map<std::string, std::set<std::string>> Callers;
+static std::map<std::string, std::set<std::string>> CalleesOf;
+// ASTs of the definitions that are aliases of an identical earlier one, kept
+// so they can be compiled on their own once that one changes
+static std::map<std::string, std::unique_ptr<FunctionAST>> AliasDefinitions;
+static std::map<std::string, std::vector<std::string>> AliasesOf;
+// constant -> definitions that read it, and the ASTs of those definitions, so
+// they can be compiled again with a new value. Definitions linked from a
+// library or a snapshot have no AST, and neither have those of -stream that
+// only read const globals.
+static std::map<std::string, std::set<std::string>> ConstantUsers;
+static std::map<std::string, std::unique_ptr<FunctionAST>> ConstantDefinitions;
+
+// forgetConstantUses - Name no longer has a body that reads constants
+static void forgetConstantUses(const std::string &Name) {
+  for (auto &[Global, Users]: ConstantUsers) {
+    Users.erase(Name);
+  }
+  ConstantDefinitions.erase(Name);
+}
+
+// retainForConstants - keep the AST of Name if it reads a constant. With
+// -stream only readers of frozen globals are kept, whose values are expected
+// to change, so memory still does not grow with the number of definitions.
+static void retainForConstants(const std::string &Name, std::unique_ptr<FunctionAST> FnAST,
+                               const std::set<std::string> &Globals) {
+  forgetConstantUses(Name);
+  bool Retain = false;
+  for (auto &Global: Globals) {
+    if (findConstant(Global)) {
+      ConstantUsers[Global].insert(Name);
+      Retain |= !StreamMode || FrozenNames.count(Global);
+    }
+  }
+  if (Retain) {
+    ConstantDefinitions[Name] = std::move(FnAST);
+  }
+}
+
+// compileDefinition - generate IR for a definition and hand it to the JIT
+static bool compileDefinition(FunctionAST &FnAST) {
+  auto *FnIR = FnAST.codegen();
+  if (!FnIR) {
+    return false;
+  }
+  if (!StreamMode) {
+    fprintf(stderr, "Read function definition:\n");
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+  }
+
+  // ahead of time, all definitions are collected in one module
+  if (TheTargetMachine) {
+    return true;
+  }
+
+  // the definition is reached through a stub so that its code can be evicted
+  std::string Name = FnIR->getName().str();
+  ExitOnErr(TheJIT->addFunction(Name, ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+  // In streaming mode compile now, so neither the AST nor the IR outlives
+  // this call; only the signature and the machine code remain. With
+  // several codegen threads, definitions are compiled a batch at a time.
+  if (StreamMode) {
+    PendingCompiles.push_back(Name);
+    if (PendingCompiles.size() >= CodeGenThreads) {
+      flushPendingCompiles();
+    }
+  }
+  InitializeModuleAndPassManagers();
+  return true;
+}
+
+// addStaleBody - replace the body of Name by one that reports the stale call;
+// its own callers keep working through its stub and fail the same way
+static void addStaleBody(const std::string &Name) {
+  Function *F = getFunction(Name);
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
+  Builder->SetInsertPoint(BB);
+  FunctionCallee StaleCall = TheModule->getOrInsertFunction(
+          "__ks_stale_call", Type::getDoubleTy(*TheContext), PointerType::getUnqual(*TheContext));
+  Builder->CreateRet(Builder->CreateCall(StaleCall, {Builder->CreateGlobalStringPtr(Name)}));
+  ExitOnErr(TheJIT->addFunction(Name, ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+  InitializeModuleAndPassManagers();
+}
+
+// disarmCaller - replace the body of Caller, which passes the wrong number
+// of arguments to Callee now
+static void disarmCaller(const std::string &Caller, const std::string &Callee) {
+  fprintf(stderr, "Warning: %s calls %s, whose number of arguments changed; it fails until it is redefined\n",
+          Caller.c_str(), Callee.c_str());
+  // force the next definition of the caller to be compiled
+  auto Hash = DefinitionHashes.find(Caller);
+  if (Hash != DefinitionHashes.end()) {
+    auto Canonical = DefinitionsByHash.find(Hash->second);
+    if (Canonical != DefinitionsByHash.end() && Canonical->second->getName() == Caller) {
+      DefinitionsByHash.erase(Canonical);
+    }
+    DefinitionHashes.erase(Hash);
+  }
+  // every alias of the caller calls Callee too, and is disarmed on its own
+  AliasesOf.erase(Caller);
+  if (AliasDefinitions.erase(Caller)) {
+    for (auto &[Target, Names]: AliasesOf) {
+      Names.erase(std::remove(Names.begin(), Names.end(), Caller), Names.end());
+    }
+  }
+  forgetConstantUses(Caller);
+  addStaleBody(Caller);
+}
+
+// prepareRedefinition - Name is about to get a different body
+static void prepareRedefinition(const std::string &Name, size_t NewArity) {
+  auto Sig = FunctionSignatures.lookup(Name);
+  if (Sig && Sig->Arity != NewArity) {
+    for (auto &Caller: Callers[Name]) {
+      if (Caller != Name && DefinitionHashes.count(Caller)) {
+        disarmCaller(Caller, Name);
+      }
+    }
+  }
+
+  // the old body no longer represents its hash
+  StructuralHash OldHash = DefinitionHashes[Name];
+  auto Canonical = DefinitionsByHash.find(OldHash);
+  if (Canonical != DefinitionsByHash.end() && Canonical->second->getName() == Name) {
+    DefinitionsByHash.erase(Canonical);
+  }
+
+  // aliases of Name keep the old body: the first one is compiled on its own
+  // and takes over the others
+  auto Aliases = AliasesOf.find(Name);
+  if (Aliases != AliasesOf.end()) {
+    std::vector<std::string> Names = std::move(Aliases->second);
+    AliasesOf.erase(Aliases);
+    auto First = AliasDefinitions.extract(Names.front());
+    if (compileDefinition(*First.mapped())) {
+      std::set<std::string> Globals;
+      First.mapped()->getStructuralHash(nullptr, &Globals);
+      retainForConstants(Names.front(), std::move(First.mapped()), Globals);
+      DefinitionsByHash[OldHash] = &FunctionSignatures.intern(Names.front());
+      for (size_t I = 1; I < Names.size(); ++I) {
+        ExitOnErr(TheJIT->addAlias(Names[I], Names.front()));
+        AliasesOf[Names.front()].push_back(Names[I]);
+      }
+    }
+  }
+
+  // Name itself may have been an alias
+  if (AliasDefinitions.erase(Name)) {
+    for (auto &[Target, Names]: AliasesOf) {
+      Names.erase(std::remove(Names.begin(), Names.end(), Name), Names.end());
+    }
+  }
+}
+
+// prepareStreamRedefinition - prepareRedefinition for -stream, which has
+// neither the dependency graph nor the ASTs of aliases. Returns whether Name
+// was defined or declared before.
+static bool prepareStreamRedefinition(const std::string &Name, size_t NewArity) {
+  auto Sig = FunctionSignatures.lookup(Name);
+  if (!Sig) {
+    return false;
+  }
+  if (Sig->Arity != NewArity) {
+    fprintf(stderr, "Warning: %s now takes %zu arguments; with -stream, the code calling it is not checked\n",
+            Name.c_str(), NewArity);
+  }
+  const SignatureRegistry::Symbol *Self = FunctionSignatures.find(Name);
+  std::erase_if(DefinitionsByHash, [&](const auto &Entry) { return Entry.second == Self; });
+  for (auto &Alias: TheJIT->getAliasesOf(Name)) {
+    fprintf(stderr, "Warning: %s was identical to %s, which changed; it fails until it is redefined\n",
+            Alias.c_str(), Name.c_str());
+    addStaleBody(Alias);
+  }
+  return true;
+}
+
 static void HandleDefinition() {
   if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:\n");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
+    std::string Name = FnAST->getProto().getName();
+    std::set<std::string> Callees, Globals;
+    StructuralHash Hash = FnAST->getStructuralHash(&Callees, &Globals);
+    bool Redefinition = false;
+    if (!TheTargetMachine && StreamMode) {
+      Redefinition = prepareStreamRedefinition(Name, FnAST->getProto().getArity());
+    } else if (!TheTargetMachine) {
+      for (auto &Callee: CalleesOf[Name]) {
+        Callers[Callee].erase(Name);
+      }
+      for (auto &Callee: Callees) {
+        Callers[Callee].insert(Name);
+      }
+      CalleesOf[Name] = Callees;
+      auto Current = DefinitionHashes.find(Name);
+      if (Current != DefinitionHashes.end()) {
+        if (Current->second == Hash) {
+          if (!StreamMode) {
+            fprintf(stderr, "Function definition %s is unchanged\n", Name.c_str());
+          }
+          return;
+        }
+        Redefinition = true;
+        prepareRedefinition(Name, FnAST->getProto().getArity());
+      }
+    }
 
-      ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-      InitializeModuleAndPassManagers();
+    // A body identical to an earlier one up to naming reuses its code. Ahead
+    // of time, MergeFunctions takes care of this on the whole module instead.
+    auto Same = DefinitionsByHash.find(Hash);
+    if (!TheTargetMachine && !Redefinition && Same != DefinitionsByHash.end()) {
+      std::string Target = Same->second->getName().str();
+      recordSignature(FnAST->getProto());
+      ExitOnErr(TheJIT->addAlias(Name, Target));
+      if (!StreamMode) {
+        fprintf(stderr, "Read function definition %s, identical to %s\n", Name.c_str(), Target.c_str());
+        DefinitionHashes[Name] = Hash;
+        AliasesOf[Target].push_back(Name);
+        AliasDefinitions[Name] = std::move(FnAST);
+      }
+      return;
+    }
+    if (compileDefinition(*FnAST)) {
+      if (!TheTargetMachine) {
+        if (!StreamMode) {
+          DefinitionHashes[Name] = Hash;
+        }
+        DefinitionsByHash.emplace(Hash, &FunctionSignatures.intern(Name));
+      }
+      retainForConstants(Name, std::move(FnAST), Globals);
     }
   } else {
     // Skip token for error recovery.
@@ -980,10 +2365,12 @@ static void HandleDefinition() {
 static void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
     if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Parsed an extern\n");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      if (!StreamMode) {
+        fprintf(stderr, "Parsed an extern\n");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+      }
+      recordSignature(*ProtoAST);
     }
   } else {
     // Skip token for error recovery.
@@ -991,10 +2378,181 @@ static void HandleExtern() {
   }
 }
 
+enum class EvaluationOutcome {
+  Finished,
+  Cancelled, // at a safepoint, e.g. by Ctrl-C
+  OverBudget // by -cpu-budget-ms or -instruction-budget
+};
+
+// EvaluationUsage - what an evaluation cost, as recorded by -accounting
+struct EvaluationUsage {
+  double CpuMs = 0;
+  double WallMs = 0;
+  bool Counted = false; // whether Instructions could be counted
+  uint64_t Instructions = 0;
+};
+
+// runEvaluation - records the evaluation itself unless Usage is given
+static EvaluationOutcome runEvaluation(double (*FP)(), double &Result, EvaluationUsage *Usage = nullptr);
+static const char *getOutcomeName(EvaluationOutcome Outcome);
+static void recordEvaluation(pid_t Pid, const char *Outcome, const EvaluationUsage &Usage);
+
+static void reportEvaluation(EvaluationOutcome Outcome, double Result) {
+  switch (Outcome) {
+    case EvaluationOutcome::Finished:
+      fprintf(stderr, "Evaluated to %f\n", Result);
+      break;
+    case EvaluationOutcome::Cancelled:
+      fprintf(stderr, "Evaluation cancelled\n");
+      break;
+    case EvaluationOutcome::OverBudget:
+      fprintf(stderr, "Evaluation exceeded its budget\n");
+      break;
+  }
+}
+
+/**
+ * Worker processes
+ *
+ * With -workers, each top-level expression runs in a child forked right after
+ * it is compiled. The child inherits the session's code copy-on-write and
+ * sends the result back over a pipe, so the compiler process survives a crash
+ * and can kill a runaway evaluation, and up to N evaluations run in parallel.
+ * Results are reported and recorded in the order of the expressions, by the
+ * session, so a killed or crashed worker is accounted for too. Call counts in the
+ * children do not reach the session, so hot recompilation only sees
+ * in-process calls.
+ */
+struct PendingEvaluation {
+  pid_t Pid;
+  int Fd;
+  std::chrono::steady_clock::time_point Start;
+};
+
+static std::deque<PendingEvaluation> PendingEvaluations;
+// for the SIGINT handler: the size of PendingEvaluations, and whether this
+// process is a worker. Ctrl-C reaches the whole process group, so each worker
+// cancels its own evaluation and the session keeps running.
+static std::atomic<size_t> PendingWorkers{0};
+static volatile sig_atomic_t IsWorker = 0;
+
+// WorkerReport - what a worker sends back
+struct WorkerReport {
+  EvaluationOutcome Outcome;
+  double Result;
+  EvaluationUsage Usage;
+};
+
+// finishEvaluation - wait for the oldest worker and report its result
+static void finishEvaluation() {
+  PendingEvaluation E = PendingEvaluations.front();
+  PendingEvaluations.pop_front();
+  --PendingWorkers;
+
+  WorkerReport Report;
+  size_t Got = 0;
+  bool TimedOut = false;
+  while (Got < sizeof(Report)) {
+    int Timeout = -1;
+    if (WorkerTimeoutMs) {
+      auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - E.Start).count();
+      Timeout = Elapsed >= WorkerTimeoutMs ? 0 : static_cast<int>(WorkerTimeoutMs - Elapsed);
+    }
+    pollfd P = {E.Fd, POLLIN, 0};
+    int Ready = poll(&P, 1, Timeout);
+    if (Ready == 0) {
+      TimedOut = true;
+      kill(E.Pid, SIGKILL);
+      break;
+    }
+    if (Ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    ssize_t Read = read(E.Fd, reinterpret_cast<char *>(&Report) + Got, sizeof(Report) - Got);
+    if (Read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (Read <= 0) {
+      break;
+    }
+    Got += Read;
+  }
+  close(E.Fd);
+  int Status = 0;
+  rusage Usage = {};
+  while (wait4(E.Pid, &Status, 0, &Usage) < 0 && errno == EINTR) {
+  }
+
+  if (Got == sizeof(Report)) {
+    reportEvaluation(Report.Outcome, Report.Result);
+    recordEvaluation(E.Pid, getOutcomeName(Report.Outcome), Report.Usage);
+    return;
+  }
+  // the worker could not report, measure it from here
+  EvaluationUsage Measured;
+  Measured.CpuMs = (Usage.ru_utime.tv_sec + Usage.ru_stime.tv_sec) * 1e3 +
+                   (Usage.ru_utime.tv_usec + Usage.ru_stime.tv_usec) / 1e3;
+  Measured.WallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - E.Start).count();
+  if (TimedOut) {
+    fprintf(stderr, "Evaluation killed after %u ms\n", (unsigned) WorkerTimeoutMs);
+    recordEvaluation(E.Pid, "killed", Measured);
+  } else if (WIFSIGNALED(Status)) {
+    fprintf(stderr, "Evaluation crashed: %s\n", strsignal(WTERMSIG(Status)));
+    recordEvaluation(E.Pid, "crashed", Measured);
+  } else {
+    fprintf(stderr, "Evaluation failed\n");
+    recordEvaluation(E.Pid, "failed", Measured);
+  }
+}
+
+static void finishEvaluations() {
+  while (!PendingEvaluations.empty()) {
+    finishEvaluation();
+  }
+}
+
+static void evaluateInWorker(double (*FP)()) {
+  while (PendingEvaluations.size() >= Workers) {
+    finishEvaluation();
+  }
+  int Fds[2];
+  if (pipe(Fds)) {
+    perror("pipe");
+    return;
+  }
+  pid_t Pid = fork();
+  if (Pid == 0) {
+    IsWorker = 1;
+    close(Fds[0]);
+    WorkerReport Report = {};
+    Report.Outcome = runEvaluation(FP, Report.Result, &Report.Usage);
+    ssize_t Written = write(Fds[1], &Report, sizeof(Report));
+    _exit(Written == sizeof(Report) ? 0 : 1);
+  }
+  close(Fds[1]);
+  if (Pid < 0) {
+    perror("fork");
+    close(Fds[0]);
+    return;
+  }
+  PendingEvaluations.push_back({Pid, Fds[0], std::chrono::steady_clock::now()});
+  ++PendingWorkers;
+}
+
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto FnAST = ParseTopLevelExpr()) {
+    if (TheTargetMachine) {
+      fprintf(stderr, "Top-level expressions are not compiled into object files\n");
+      return;
+    }
     if (FnAST->codegen()) {
+      flushPendingCompiles();
+
       // Create a ResourceTracker to track JIT's memory allocated to our
       // anonymous expression -- that way we can free it after execution
       auto RT = TheJIT->getMainJITDylib().createResourceTracker();
@@ -1010,10 +2568,24 @@ static void HandleTopLevelExpression() {
       // arguments, returns a double) so we can call it as a native function.
       double (*FP)() = ExprSymbol.getAddress().toPtr < double(*)
       () > ();
-      fprintf(stderr, "Evaluated to %f\n", FP());
+      if (Workers) {
+        // the worker must not compile: compile everything it may call here
+        ExitOnErr(TheJIT->compileAll());
+        evaluateInWorker(FP);
+      } else {
+        double Result;
+        EvaluationOutcome Outcome = runEvaluation(FP, Result);
+        reportEvaluation(Outcome, Result);
+      }
 
       // Delete the anonymous expression module from the JIT
       ExitOnErr(RT->remove());
+
+      // Nothing JIT'd is running now, so cold definitions can be dropped safely
+      ExitOnErr(TheJIT->enforceCodeBudget());
+      if (HotCallThreshold) {
+        ExitOnErr(TheJIT->recompileHotFunctions(HotCallThreshold));
+      }
     }
   } else {
     // Skip token for error recovery.
@@ -1022,56 +2594,1703 @@ static void HandleTopLevelExpression() {
 }
 
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-  while (true) {
-    fprintf(stderr, "ready> ");
-    switch (CurTok) {
-      case tok_eof:
-        return;
-      case ';':
-        getNextToken();
-        break;
-      case tok_def:
-        HandleDefinition();
-        break;
-      case tok_extern:
-        HandleExtern();
-        break;
-      default:
-        HandleTopLevelExpression();
-        break;
+// imports made by the library being compiled, if any
+static std::vector<std::string> *LibraryImports = nullptr;
+
+/**
+ * Constants
+ *
+ * const name = expr evaluates expr once and makes name a global whose value is
+ * compiled into every function that reads it, so the optimizer can fold it.
+ * Frozen globals are the same, except that their values come from the host
+ * (-frozen, -frozen-file) and take precedence over const definitions. When a
+ * value changes, the definitions that read it are compiled again from their
+ * retained ASTs; in the JIT they replace the old bodies behind the stubs, so
+ * callers pick them up without being recompiled themselves.
+ */
+
+static sys::TimePoint<> FrozenFileTime;
+
+// recompileConstantUsers - compile the definitions that read Name again
+static void recompileConstantUsers(const std::string &Name) {
+  auto Users = ConstantUsers.find(Name);
+  if (Users == ConstantUsers.end()) {
+    return;
+  }
+  if (LibraryImports) {
+    // the library module is being built, session code cannot be added now
+    fprintf(stderr, "Warning: code already compiled keeps the old value of %s\n", Name.c_str());
+    return;
+  }
+  for (auto &User: Users->second) {
+    auto Definition = ConstantDefinitions.find(User);
+    if (Definition == ConstantDefinitions.end()) {
+      // linked from a library or a snapshot, or not kept by -stream
+      fprintf(stderr, "Warning: %s keeps the old value of %s\n", User.c_str(), Name.c_str());
+      continue;
+    }
+    FunctionAST &FnAST = *Definition->second;
+    if (!StreamMode) {
+      fprintf(stderr, "Recompiling %s for the new value of %s\n", User.c_str(), Name.c_str());
+    }
+    if (TheTargetMachine) {
+      if (Function *F = TheModule->getFunction(User)) {
+        F->deleteBody();
+      }
+      compileDefinition(FnAST);
+      continue;
+    }
+    if (StreamMode) {
+      // no hash is kept per definition: the entry of the old body only
+      // matches again once the value is back, and so is the body
+      compileDefinition(FnAST);
+      continue;
+    }
+    // the old body no longer represents its hash, its aliases follow the stub
+    StructuralHash OldHash = DefinitionHashes[User];
+    auto Canonical = DefinitionsByHash.find(OldHash);
+    if (Canonical != DefinitionsByHash.end() && Canonical->second->getName() == User) {
+      DefinitionsByHash.erase(Canonical);
+    }
+    if (compileDefinition(FnAST)) {
+      StructuralHash Hash = FnAST.getStructuralHash();
+      DefinitionHashes[User] = Hash;
+      DefinitionsByHash.emplace(Hash, &FunctionSignatures.intern(User));
+      for (auto &Alias: AliasesOf[User]) {
+        DefinitionHashes[Alias] = Hash;
+      }
     }
   }
 }
 
-//===----------------------------------------------------------------------===//
-// "Library" functions that can be "extern'd" from user code.
-//===----------------------------------------------------------------------===//
+// setConstant - give Name a value, recompiling its readers if it changed
+static void setConstant(const std::string &Name, double Value) {
+  auto [I, Inserted] = ConstantValues.try_emplace(Name, Value);
+  if (Inserted || DoubleToBits(I->second) == DoubleToBits(Value)) {
+    return;
+  }
+  I->second = Value;
+  recompileConstantUsers(Name);
+}
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
+static void setFrozenValue(const std::string &Name, double Value) {
+  FrozenNames.insert(Name);
+  setConstant(Name, Value);
+}
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char) X, stderr);
-  return 0;
+// parseFrozenValue - name=value, with optional blanks around both
+static bool parseFrozenValue(StringRef Line, std::string &Name, double &Value) {
+  auto [NameStr, ValueStr] = Line.split('=');
+  NameStr = NameStr.trim();
+  ValueStr = ValueStr.trim();
+  if (NameStr.empty() || ValueStr.empty() || ValueStr.getAsDouble(Value)) {
+    return false;
+  }
+  Name = NameStr.str();
+  return true;
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
+// reloadFrozenValues - read FrozenFilename again if it changed since the last time
+static void reloadFrozenValues() {
+  if (FrozenFilename.empty()) {
+    return;
+  }
+  sys::fs::file_status Status;
+  if (sys::fs::status(FrozenFilename, Status) || Status.getLastModificationTime() == FrozenFileTime) {
+    return;
+  }
+  FrozenFileTime = Status.getLastModificationTime();
+  auto Buffer = MemoryBuffer::getFile(FrozenFilename);
+  if (!Buffer) {
+    fprintf(stderr, "Could not read %s\n", FrozenFilename.c_str());
+    return;
+  }
+  StringRef Rest = (*Buffer)->getBuffer();
+  while (!Rest.empty()) {
+    StringRef Line;
+    std::tie(Line, Rest) = Rest.split('\n');
+    Line = Line.split('#').first.trim();
+    if (Line.empty()) {
+      continue;
+    }
+    std::string Name;
+    double Value;
+    if (parseFrozenValue(Line, Name, Value)) {
+      setFrozenValue(Name, Value);
+    } else {
+      fprintf(stderr, "Ignoring \"%s\" in %s\n", Line.str().c_str(), FrozenFilename.c_str());
+    }
+  }
 }
 
-//===----------------------------------------------------------------------===//
-// Main driver code.
-//===----------------------------------------------------------------------===//
+// evaluateConstant - the value of the initializer of a const
+static std::optional<double> evaluateConstant(std::unique_ptr<ExprAST> Init) {
+  auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+  FunctionAST FnAST(std::move(Proto), std::move(Init));
+  Function *F = FnAST.codegen();
+  if (!F) {
+    return std::nullopt;
+  }
+
+  // ahead of time, or inside a library, nothing can run: the initializer must
+  // have been folded to a constant
+  if (TheTargetMachine || LibraryImports) {
+    std::optional<double> Result;
+    for (auto &BB: *F) {
+      if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator())) {
+        if (auto *C = dyn_cast<ConstantFP>(Ret->getReturnValue())) {
+          Result = C->getValueAPF().convertToDouble();
+        }
+      }
+    }
+    F->eraseFromParent();
+    if (!Result) {
+      LogError("const must be a constant expression here");
+    }
+    return Result;
+  }
+
+  flushPendingCompiles();
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT));
+  InitializeModuleAndPassManagers();
+  auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+  double Result;
+  EvaluationOutcome Outcome = runEvaluation(ExprSymbol.getAddress().toPtr<double (*)()>(), Result);
+  ExitOnErr(RT->remove());
+  if (Outcome != EvaluationOutcome::Finished) {
+    reportEvaluation(Outcome, Result);
+    return std::nullopt;
+  }
+  return Result;
+}
+
+// HandleConst - const name = expr; the values a library defines are appended
+// to Record so they can be cached with it
+static void HandleConst(std::vector<std::pair<std::string, double>> *Record = nullptr) {
+  std::string Name;
+  auto Init = ParseConst(Name);
+  if (!Init) {
+    // Skip token for error recovery.
+    getNextToken();
+    return;
+  }
+  auto Value = evaluateConstant(std::move(Init));
+  if (!Value) {
+    return;
+  }
+  if (FrozenNames.count(Name)) {
+    fprintf(stderr, "%s is frozen by the host, keeping %f\n", Name.c_str(), *findConstant(Name));
+    return;
+  }
+  setConstant(Name, *Value);
+  if (Record) {
+    Record->emplace_back(Name, *Value);
+  }
+  if (!StreamMode) {
+    fprintf(stderr, "Read const %s = %f\n", Name.c_str(), *Value);
+  }
+}
+
+// getResidentBytes - current resident set size of this process, 0 if unknown
+static size_t getResidentBytes() {
+#ifdef __APPLE__
+  mach_task_basic_info Info;
+  mach_msg_type_number_t Count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &Info, &Count) != KERN_SUCCESS) {
+    return 0;
+  }
+  return Info.resident_size;
+#else
+  long Pages = 0, Resident = 0;
+  FILE *F = fopen("/proc/self/statm", "r");
+  if (!F) {
+    return 0;
+  }
+  if (fscanf(F, "%ld %ld", &Pages, &Resident) != 2) {
+    Resident = 0;
+  }
+  fclose(F);
+  return Resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/**
+ * Tenant benchmark
+ *
+ * Every tenant defines its own f(x) = x + i and an expression calling f(1),
+ * which must see that f and no other. All tenants stay resident until the last
+ * one is created, so the resident memory per tenant can be read off too.
+ */
+
+static void reportLatencies(const char *Step, std::vector<double> &Micros) {
+  if (Micros.empty()) {
+    return;
+  }
+  std::sort(Micros.begin(), Micros.end());
+  auto At = [&](double Q) { return Micros[std::min(Micros.size() - 1, (size_t) (Q * Micros.size()))]; };
+  fprintf(stderr, "[tenants] %-8s p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", Step, At(0.5), At(0.99),
+          Micros.back());
+}
+
+static ThreadSafeModule buildTenantModule(unsigned Index) {
+  auto Context = std::make_unique<LLVMContext>();
+  auto M = std::make_unique<Module>("tenant", *Context);
+  M->setDataLayout(TheJIT->getDataLayout());
+  IRBuilder<> B(*Context);
+  Type *DoubleTy = B.getDoubleTy();
+
+  Function *F = Function::Create(FunctionType::get(DoubleTy, {DoubleTy}, false), Function::ExternalLinkage,
+                                 "f", *M);
+  B.SetInsertPoint(BasicBlock::Create(*Context, "entry", F));
+  B.CreateRet(B.CreateFAdd(F->getArg(0), ConstantFP::get(DoubleTy, Index)));
+
+  Function *Expr = Function::Create(FunctionType::get(DoubleTy, false), Function::ExternalLinkage,
+                                    "__anon_expr", *M);
+  B.SetInsertPoint(BasicBlock::Create(*Context, "entry", Expr));
+  B.CreateRet(B.CreateCall(F, {ConstantFP::get(DoubleTy, 1.0)}));
+  return ThreadSafeModule(std::move(M), std::move(Context));
+}
+
+static bool runTenantBenchmark(unsigned N) {
+  using Clock = std::chrono::steady_clock;
+  auto Micros = [](Clock::time_point Start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - Start).count();
+  };
+  std::vector<double> Create, Compile, Call, Remove;
+  std::vector<JITDylib *> Tenants;
+  size_t ResidentBefore = getResidentBytes();
+
+  for (unsigned I = 0; I < N; ++I) {
+    auto Start = Clock::now();
+    JITDylib &JD = ExitOnErr(TheJIT->createTenant(std::to_string(I)));
+    Create.push_back(Micros(Start));
+    Tenants.push_back(&JD);
+
+    Start = Clock::now();
+    ExitOnErr(TheJIT->addToTenant(JD, buildTenantModule(I)));
+    auto Expr = ExitOnErr(TheJIT->lookupInTenant(JD, "__anon_expr"));
+    Compile.push_back(Micros(Start));
+
+    Start = Clock::now();
+    double Result = Expr.getAddress().toPtr<double (*)()>()();
+    Call.push_back(Micros(Start));
+    if (Result != 1.0 + I) {
+      fprintf(stderr, "Tenant %u called the wrong f: got %f\n", I, Result);
+      return false;
+    }
+  }
+  size_t ResidentAll = getResidentBytes();
+
+  for (auto *JD: Tenants) {
+    auto Start = Clock::now();
+    ExitOnErr(TheJIT->removeTenant(*JD));
+    Remove.push_back(Micros(Start));
+  }
+
+  fprintf(stderr, "[tenants] %u tenants\n", N);
+  reportLatencies("create", Create);
+  reportLatencies("compile", Compile);
+  reportLatencies("call", Call);
+  reportLatencies("remove", Remove);
+  if (ResidentBefore && ResidentAll > ResidentBefore) {
+    fprintf(stderr, "[tenants] resident %.1f KiB per tenant\n",
+            (ResidentAll - ResidentBefore) / 1024.0 / N);
+  }
+  return true;
+}
+
+/**
+ * Signature registry benchmark
+ *
+ * Each thread builds modules of one function with 1000 calls in its own
+ * context, declaring every callee from its signature the way getFunction()
+ * does, so the lookups are interleaved with real IR construction. The same work against a StringMap
+ * behind one mutex shows what the registry saves under contention.
+ */
+
+static double runSignatureWorkload(unsigned Threads, const std::vector<std::string> &Names,
+                                   const std::function<std::optional<FunctionSignature>(StringRef)> &Lookup) {
+  const unsigned CallsPerThread = 200000, CallsPerFunction = 1000;
+  auto Start = std::chrono::steady_clock::now();
+  std::vector<std::thread> Workers;
+  for (unsigned T = 0; T < Threads; ++T) {
+    Workers.emplace_back([&, T]() {
+      LLVMContext Context;
+      std::unique_ptr<Module> M;
+      IRBuilder<> B(Context);
+      Type *DoubleTy = B.getDoubleTy();
+      Value *Arg = ConstantFP::get(DoubleTy, 1.0);
+      for (unsigned I = 0; I < CallsPerThread; ++I) {
+        if (I % CallsPerFunction == 0) {
+          // like the driver, every definition gets a fresh module
+          M = std::make_unique<Module>("calls", Context);
+          Function *Caller = Function::Create(FunctionType::get(DoubleTy, false), Function::ExternalLinkage,
+                                              "caller", *M);
+          B.SetInsertPoint(BasicBlock::Create(Context, "entry", Caller));
+        }
+        StringRef Name = Names[(I * 7919 + T * 104729) % Names.size()];
+        Function *Callee = M->getFunction(Name);
+        if (!Callee) {
+          auto Sig = Lookup(Name);
+          std::vector<Type *> Doubles(Sig->Arity, DoubleTy);
+          Callee = Function::Create(FunctionType::get(DoubleTy, Doubles, false), Function::ExternalLinkage, Name,
+                                    *M);
+          Callee->setCallingConv(Sig->CC);
+        }
+        std::vector<Value *> Args(Callee->arg_size(), Arg);
+        B.CreateCall(Callee, Args);
+      }
+    });
+  }
+  for (auto &W: Workers) {
+    W.join();
+  }
+  double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+  return Threads * CallsPerThread / Seconds / 1e6;
+}
+
+static void runSignatureBenchmark(unsigned MaxThreads) {
+  const unsigned Functions = 100000;
+  std::vector<std::string> Names;
+  SignatureRegistry Registry;
+  StringMap<FunctionSignature> Locked;
+  std::mutex LockedMutex;
+  for (unsigned I = 0; I < Functions; ++I) {
+    Names.push_back("f" + std::to_string(I));
+    Registry.set(Names.back(), {I % 8, CallingConv::C});
+    Locked[Names.back()] = {I % 8, CallingConv::C};
+  }
+
+  for (unsigned Threads = 1;; Threads = std::min(Threads * 2, MaxThreads)) {
+    double Lockless = runSignatureWorkload(Threads, Names, [&](StringRef Name) {
+      return Registry.lookup(Name);
+    });
+    double Mutex = runSignatureWorkload(Threads, Names, [&](StringRef Name) -> std::optional<FunctionSignature> {
+      std::lock_guard<std::mutex> Lock(LockedMutex);
+      auto I = Locked.find(Name);
+      if (I == Locked.end()) {
+        return std::nullopt;
+      }
+      return I->second;
+    });
+    fprintf(stderr, "[signatures] %3u threads: registry %8.2f Mcalls/s, mutex %8.2f Mcalls/s\n", Threads,
+            Lockless, Mutex);
+    if (Threads == MaxThreads) {
+      break;
+    }
+  }
+}
+
+/// top ::= definition | external | const | expression | ';'
+static void HandleImport();
+static void HandleSnapshot();
+
+static void MainLoop() {
+  uint64_t Items = 0;
+  while (true) {
+    if (!StreamMode) {
+      fprintf(stderr, "ready> ");
+    }
+    // the host may have changed frozen values since the last item
+    reloadFrozenValues();
+    switch (CurTok) {
+      case tok_eof:
+        // -stream compiles definitions in batches, the last one may be partial
+        flushPendingCompiles();
+        finishEvaluations();
+        return;
+      case ';':
+        getNextToken();
+        continue;
+      case tok_def:
+        HandleDefinition();
+        break;
+      case tok_extern:
+        HandleExtern();
+        break;
+      case tok_const:
+        HandleConst();
+        break;
+      case tok_import:
+        HandleImport();
+        break;
+      case tok_snapshot:
+        HandleSnapshot();
+        break;
+      default:
+        HandleTopLevelExpression();
+        break;
+    }
+    // memory over time, one sample every MemReportInterval items
+    if (MemReportInterval && ++Items % MemReportInterval == 0) {
+      fprintf(stderr, "[mem] items=%llu rss=%zu KiB\n",
+              (unsigned long long) Items, getResidentBytes() / 1024);
+    }
+  }
+}
+
+// WatchLoop - run WatchFilename, then run it again whenever it is saved.
+// Definitions that did not change are not recompiled, see HandleDefinition.
+static bool WatchLoop() {
+  sys::TimePoint<> LastRun;
+  while (true) {
+    sys::fs::file_status Status;
+    if (std::error_code EC = sys::fs::status(WatchFilename, Status)) {
+      errs() << "Could not read " << WatchFilename << ": " << EC.message() << "\n";
+      return false;
+    }
+    if (Status.getLastModificationTime() == LastRun) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      reloadFrozenValues();
+      continue;
+    }
+    LastRun = Status.getLastModificationTime();
+
+    Input = fopen(WatchFilename.c_str(), "r");
+    if (!Input) {
+      errs() << "Could not open " << WatchFilename << "\n";
+      return false;
+    }
+    fprintf(stderr, "Running %s\n", WatchFilename.c_str());
+    ImportDir = sys::path::parent_path(WatchFilename).str();
+    LastChar = ' ';
+    getNextToken();
+    MainLoop();
+    flushPendingCompiles();
+    fclose(Input);
+    Input = stdin;
+    fprintf(stderr, "Watching %s for changes\n", WatchFilename.c_str());
+  }
+}
+
+/**
+ * Modules
+ *
+ * import "lib.ks" makes the definitions of another file available. In the JIT
+ * the file is compiled as a whole into one object file, which is cached next
+ * to the source as lib.ksm together with the signatures it defines, and linked
+ * into a JITDylib of its own. Later imports of an unchanged file only map the
+ * cached object and link it. Ahead of time, the definitions are simply
+ * compiled into the object file being written.
+ *
+ * The key of a library is its hash together with the keys of its imports, so
+ * a library is rebuilt when one of the libraries it was compiled against
+ * changed, even if its own source did not.
+ *
+ * lib.ksm is a few header lines followed by the object file:
+ *   ksm 3
+ *   hash <BLAKE3 of the source, the host triple and CPU, and -safepoints>
+ *   import <file> <key>    imports of lib.ks, in order, and their keys then
+ *   def <name> <arity>     definitions of lib.ks
+ *   const <name> <bits>    constants of lib.ks, as hex IEEE-754 bits
+ *   use <const> <name>     constants compiled into the definitions
+ *   object <size>
+ * The object starts at the next 16 byte boundary.
+ */
+
+static std::set<std::string> ImportedFiles;
+// libraries imported by the session (not the prelude), in order
+static std::vector<std::string> SessionImports;
+// mapped artifacts, which the linked objects point into
+static std::vector<std::unique_ptr<MemoryBuffer>> LoadedArtifacts;
+// key of each library imported so far
+static std::map<std::string, std::string> LibraryKeys;
+
+struct LibraryArtifact {
+  std::vector<std::string> Imports;
+  std::vector<std::string> ImportKeys;
+  std::vector<std::pair<std::string, unsigned>> Definitions;
+  std::vector<std::pair<std::string, double>> Constants;
+  // constant, definition that read it
+  std::vector<std::pair<std::string, std::string>> Uses;
+  std::unique_ptr<MemoryBuffer> Object;
+};
+
+static void importOnce(const std::string &Path, bool Prelude = false);
+
+static std::string getArtifactHash(StringRef Source) {
+  std::string Key = "ksm 3\n" + sys::getProcessTriple() + "\n" + sys::getHostCPUName().str() + "\n";
+  // whether the code polls for safepoints
+  Key += Safepoints ? "safepoints\n" : "\n";
+  // the library may read constants of the session, which are compiled in
+  for (auto &[Name, Value]: ConstantValues) {
+    Key += Name + "=" + utohexstr(DoubleToBits(Value)) + "\n";
+  }
+  Key += Source;
+  return toHex(BLAKE3::hash<16>(arrayRefFromStringRef(Key)), true);
+}
+
+static std::string getLibraryKey(StringRef Hash, const std::vector<std::string> &ImportKeys) {
+  std::string Key = Hash.str() + "\n";
+  for (auto &ImportKey: ImportKeys) {
+    Key += ImportKey + "\n";
+  }
+  return toHex(BLAKE3::hash<16>(arrayRefFromStringRef(Key)), true);
+}
+
+static std::string getArtifactPath(const std::string &Path) {
+  SmallString<128> ArtifactPath(Path);
+  sys::path::replace_extension(ArtifactPath, "ksm");
+  return ArtifactPath.str().str();
+}
+
+// loadArtifact - the cached library, if it was built from this source
+static std::optional<LibraryArtifact> loadArtifact(const std::string &ArtifactPath, StringRef Hash) {
+  auto Buffer = MemoryBuffer::getFile(ArtifactPath, false, false);
+  if (!Buffer) {
+    return std::nullopt;
+  }
+  LibraryArtifact Artifact;
+  StringRef Rest = (*Buffer)->getBuffer();
+  StringRef Line;
+  std::tie(Line, Rest) = Rest.split('\n');
+  if (Line != "ksm 3") {
+    return std::nullopt;
+  }
+  std::tie(Line, Rest) = Rest.split('\n');
+  if (Line != ("hash " + Hash).str()) {
+    return std::nullopt;
+  }
+  while (!Rest.empty()) {
+    std::tie(Line, Rest) = Rest.split('\n');
+    auto [Kind, Args] = Line.split(' ');
+    if (Kind == "import") {
+      auto [Import, ImportKey] = Args.rsplit(' ');
+      Artifact.Imports.push_back(Import.str());
+      Artifact.ImportKeys.push_back(ImportKey.str());
+    } else if (Kind == "def") {
+      auto [Name, ArityStr] = Args.rsplit(' ');
+      unsigned Arity;
+      if (ArityStr.getAsInteger(10, Arity)) {
+        return std::nullopt;
+      }
+      Artifact.Definitions.emplace_back(Name.str(), Arity);
+    } else if (Kind == "const") {
+      auto [Name, Bits] = Args.rsplit(' ');
+      uint64_t Value;
+      if (Bits.getAsInteger(16, Value)) {
+        return std::nullopt;
+      }
+      Artifact.Constants.emplace_back(Name.str(), BitsToDouble(Value));
+    } else if (Kind == "use") {
+      auto [Global, Name] = Args.split(' ');
+      Artifact.Uses.emplace_back(Global.str(), Name.str());
+    } else if (Kind == "object") {
+      size_t Size;
+      size_t Offset = alignTo(Rest.data() - (*Buffer)->getBufferStart(), 16);
+      if (Args.getAsInteger(10, Size) || Offset + Size > (*Buffer)->getBufferSize()) {
+        return std::nullopt;
+      }
+      Artifact.Object = MemoryBuffer::getMemBuffer((*Buffer)->getBuffer().substr(Offset, Size),
+                                                   ArtifactPath, false);
+      LoadedArtifacts.push_back(std::move(*Buffer));
+      return Artifact;
+    } else {
+      return std::nullopt;
+    }
+  }
+  return std::nullopt;
+}
+
+static void writeArtifact(const std::string &ArtifactPath, StringRef Hash, const LibraryArtifact &Artifact) {
+  std::string Header = "ksm 3\nhash " + Hash.str() + "\n";
+  for (size_t I = 0; I < Artifact.Imports.size(); ++I) {
+    Header += "import " + Artifact.Imports[I] + " " + Artifact.ImportKeys[I] + "\n";
+  }
+  for (auto &[Name, Arity]: Artifact.Definitions) {
+    Header += "def " + Name + " " + std::to_string(Arity) + "\n";
+  }
+  for (auto &[Name, Value]: Artifact.Constants) {
+    Header += "const " + Name + " " + utohexstr(DoubleToBits(Value)) + "\n";
+  }
+  for (auto &[Global, Name]: Artifact.Uses) {
+    Header += "use " + Global + " " + Name + "\n";
+  }
+  Header += "object " + std::to_string(Artifact.Object->getBufferSize()) + "\n";
+  Header.resize(alignTo(Header.size(), 16), '\0');
+
+  std::error_code EC;
+  raw_fd_ostream OS(ArtifactPath, EC, sys::fs::OF_None);
+  if (EC) {
+    fprintf(stderr, "Warning: could not cache %s: %s\n", ArtifactPath.c_str(), EC.message().c_str());
+    return;
+  }
+  OS << Header << Artifact.Object->getBuffer();
+}
+
+// compileLibrary - parse and compile every definition of Path into one module
+static LibraryArtifact compileLibrary(const std::string &Path) {
+  // set aside the module being built, an import can happen inside another
+  auto OuterContext = std::move(TheContext);
+  auto OuterModule = std::move(TheModule);
+  auto OuterBuilder = std::move(Builder);
+  InitializeModuleAndPassManagers();
+
+  LibraryArtifact Artifact;
+  auto *OuterImports = LibraryImports;
+  LibraryImports = &Artifact.Imports;
+  getNextToken();
+  while (CurTok != tok_eof) {
+    switch (CurTok) {
+      case ';':
+        getNextToken();
+        break;
+      case tok_def:
+        if (auto FnAST = ParseDefinition()) {
+          const PrototypeAST &Proto = FnAST->getProto();
+          std::set<std::string> Globals;
+          FnAST->getStructuralHash(nullptr, &Globals);
+          if (FnAST->codegen()) {
+            Artifact.Definitions.emplace_back(Proto.getName(), Proto.getArity());
+            for (auto &Global: Globals) {
+              if (findConstant(Global)) {
+                Artifact.Uses.emplace_back(Global, Proto.getName());
+              }
+            }
+          }
+        } else {
+          getNextToken();
+        }
+        break;
+      case tok_extern:
+        HandleExtern();
+        break;
+      case tok_const:
+        HandleConst(&Artifact.Constants);
+        break;
+      case tok_import:
+        HandleImport();
+        break;
+      default:
+        fprintf(stderr, "Top-level expressions in imported files are ignored\n");
+        if (!ParseTopLevelExpr()) {
+          getNextToken();
+        }
+        break;
+    }
+  }
+  LibraryImports = OuterImports;
+
+  Artifact.Object = ExitOnErr(TheJIT->compileToObject(*TheModule));
+
+  TheContext = std::move(OuterContext);
+  TheModule = std::move(OuterModule);
+  Builder = std::move(OuterBuilder);
+  InitializePassManagers();
+  return Artifact;
+}
+
+// importFile - make the definitions of Path available, reading it from the
+// current lexer position of Input. The prelude is linked into the shared
+// prelude dylib rather than a library dylib of the session.
+static void importFile(const std::string &Path, bool Prelude) {
+  // ahead of time the imported definitions become part of the output
+  if (TheTargetMachine) {
+    getNextToken();
+    MainLoop();
+    return;
+  }
+
+  auto Source = MemoryBuffer::getFile(Path);
+  if (!Source) {
+    fprintf(stderr, "Could not read %s\n", Path.c_str());
+    return;
+  }
+  std::string Hash = getArtifactHash((*Source)->getBuffer());
+  std::string ArtifactPath = getArtifactPath(Path);
+  LibraryArtifact Artifact;
+  auto Cached = loadArtifact(ArtifactPath, Hash);
+  if (Cached) {
+    for (auto &Import: Cached->Imports) {
+      importOnce(Import);
+    }
+    // the object was compiled against the imports as they were then
+    for (size_t I = 0; Cached && I < Cached->Imports.size(); ++I) {
+      auto Current = LibraryKeys.find(Cached->Imports[I]);
+      if (Current == LibraryKeys.end() || Current->second != Cached->ImportKeys[I]) {
+        fprintf(stderr, "Recompiling %s, %s changed\n", Path.c_str(), Cached->Imports[I].c_str());
+        Cached.reset();
+      }
+    }
+  }
+  if (Cached) {
+    Artifact = std::move(*Cached);
+    for (auto &[Name, Arity]: Artifact.Definitions) {
+      FunctionSignatures.set(Name, {Arity, CallingConv::C});
+    }
+    for (auto &[Name, Value]: Artifact.Constants) {
+      if (!FrozenNames.count(Name)) {
+        setConstant(Name, Value);
+      }
+    }
+  } else {
+    Artifact = compileLibrary(Path);
+    for (auto &Import: Artifact.Imports) {
+      Artifact.ImportKeys.push_back(LibraryKeys[Import]);
+    }
+    writeArtifact(ArtifactPath, Hash, Artifact);
+  }
+  LibraryKeys[Path] = getLibraryKey(Hash, Artifact.ImportKeys);
+  // the linked code keeps these values if they change later
+  for (auto &[Global, Name]: Artifact.Uses) {
+    ConstantUsers[Global].insert(Name);
+  }
+  if (Prelude) {
+    ExitOnErr(TheJIT->setPrelude(std::move(Artifact.Object)));
+  } else {
+    std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+    Objects.push_back(std::move(Artifact.Object));
+    ExitOnErr(TheJIT->addLibrary(Path, std::move(Objects)));
+  }
+}
+
+// importOnce - import Path unless this session already did
+static void importOnce(const std::string &Path, bool Prelude) {
+  if (!ImportedFiles.insert(Path).second) {
+    return;
+  }
+  FILE *F = fopen(Path.c_str(), "r");
+  if (!F) {
+    fprintf(stderr, "Could not open %s\n", Path.c_str());
+    return;
+  }
+  if (!Prelude) {
+    SessionImports.push_back(Path);
+  }
+  // read the imported file, then continue where the import was, including
+  // the current token: the prelude and -restore import after the first token
+  // of the session has been read
+  FILE *OuterInput = Input;
+  int OuterLastChar = LastChar;
+  int OuterTok = CurTok;
+  std::string OuterIdentifierStr = IdentifierStr;
+  double OuterNumVal = NumVal;
+  std::string OuterStringVal = StringVal;
+  std::string OuterImportDir = ImportDir;
+  Input = F;
+  LastChar = ' ';
+  ImportDir = sys::path::parent_path(Path).str();
+  importFile(Path, Prelude);
+  fclose(F);
+  Input = OuterInput;
+  LastChar = OuterLastChar;
+  CurTok = OuterTok;
+  IdentifierStr = OuterIdentifierStr;
+  NumVal = OuterNumVal;
+  StringVal = OuterStringVal;
+  ImportDir = OuterImportDir;
+}
+
+// HandleImport - import "file"
+static void HandleImport() {
+  getNextToken(); // eat import
+  if (CurTok != tok_string) {
+    LogError("Expected a file name in quotes after import");
+    return;
+  }
+  SmallString<128> Path(StringVal);
+  if (sys::path::is_relative(Path) && !ImportDir.empty()) {
+    sys::fs::make_absolute(ImportDir, Path);
+  }
+  SmallString<128> RealPath;
+  std::string Key = sys::fs::real_path(Path, RealPath) ? Path.str().str() : RealPath.str().str();
+  if (LibraryImports) {
+    LibraryImports->push_back(Key);
+  }
+  importOnce(Key);
+  getNextToken();
+}
+
+/**
+ * Snapshots
+ *
+ * snapshot "session.kss" writes everything needed to get the session back
+ * without parsing or compiling: the imports to replay (they come from their
+ * cached artifacts), the signature table, the aliases between identical
+ * definitions and one object file per definition. -restore maps the file and
+ * links the objects into a dylib that session code resolves against.
+ *
+ *   kss 1
+ *   target <host triple> <host CPU> [safepoints] [<frozen name>=<bits> ...]
+ *   const <name> <bits>
+ *   import <file>
+ *   sig <name> <arity>
+ *   alias <name> <target>
+ *   use <const> <name>
+ *   object <name> <size>
+ *   end
+ * The objects follow, in order, each starting at a 16 byte boundary.
+ */
+
+// objects of a restored snapshot, pointing into its mapped file; they are
+// written again by later snapshots unless the definition was replaced
+static std::map<std::string, StringRef> RestoredObjects;
+
+static std::string getSnapshotTarget() {
+  // code without safepoint polls could be neither cancelled nor metered
+  std::string Target = sys::getProcessTriple() + " " + sys::getHostCPUName().str();
+  if (Safepoints) {
+    Target += " safepoints";
+  }
+  // the objects cannot be compiled again for other frozen values
+  for (auto &Name: FrozenNames) {
+    Target += " " + Name + "=" + utohexstr(DoubleToBits(*findConstant(Name)));
+  }
+  return Target;
+}
+
+static bool writeSnapshot(const std::string &Path) {
+  auto Compiled = TheJIT->compileDefinitions();
+  if (!Compiled) {
+    errs() << "Could not take a snapshot: " << toString(Compiled.takeError()) << "\n";
+    return false;
+  }
+  std::map<std::string, StringRef> Objects = RestoredObjects;
+  for (auto &[Name, Obj]: *Compiled) {
+    Objects[Name] = Obj->getBuffer();
+  }
+
+  std::string Header = "kss 1\ntarget " + getSnapshotTarget() + "\n";
+  // constants first: imports that miss their cache are compiled on restore,
+  // and may read them
+  for (auto &[Name, Value]: ConstantValues) {
+    Header += "const " + Name + " " + utohexstr(DoubleToBits(Value)) + "\n";
+  }
+  for (auto &Import: SessionImports) {
+    Header += "import " + Import + "\n";
+  }
+  FunctionSignatures.forEach([&](StringRef Name, FunctionSignature Sig) {
+    Header += "sig " + Name.str() + " " + std::to_string(Sig.Arity) + "\n";
+  });
+  for (auto &[Target, Names]: AliasesOf) {
+    for (auto &Name: Names) {
+      Header += "alias " + Name + " " + Target + "\n";
+    }
+  }
+  for (auto &[Global, Users]: ConstantUsers) {
+    for (auto &User: Users) {
+      Header += "use " + Global + " " + User + "\n";
+    }
+  }
+  for (auto &[Name, Obj]: Objects) {
+    Header += "object " + Name + " " + std::to_string(Obj.size()) + "\n";
+  }
+  Header += "end\n";
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << "Could not open file: " << EC.message() << "\n";
+    return false;
+  }
+  OS << Header;
+  uint64_t Offset = Header.size();
+  for (auto &[Name, Obj]: Objects) {
+    OS.write_zeros(alignTo(Offset, 16) - Offset);
+    OS << Obj;
+    Offset = alignTo(Offset, 16) + Obj.size();
+  }
+  fprintf(stderr, "Wrote %s: %zu definitions\n", Path.c_str(), Objects.size());
+  return true;
+}
+
+static bool restoreSnapshot(const std::string &Path) {
+  auto Buffer = MemoryBuffer::getFile(Path, false, false);
+  if (!Buffer) {
+    fprintf(stderr, "Could not read %s\n", Path.c_str());
+    return false;
+  }
+  StringRef Rest = (*Buffer)->getBuffer();
+  StringRef Line;
+  std::tie(Line, Rest) = Rest.split('\n');
+  if (Line != "kss 1") {
+    fprintf(stderr, "%s is not a snapshot\n", Path.c_str());
+    return false;
+  }
+  std::tie(Line, Rest) = Rest.split('\n');
+  if (Line != "target " + getSnapshotTarget()) {
+    fprintf(stderr, "%s was taken on a different target or with other frozen values\n", Path.c_str());
+    return false;
+  }
+
+  std::vector<std::pair<std::string, size_t>> Sizes;
+  std::map<std::string, std::string> Aliases;
+  while (true) {
+    if (Rest.empty()) {
+      fprintf(stderr, "%s is truncated\n", Path.c_str());
+      return false;
+    }
+    std::tie(Line, Rest) = Rest.split('\n');
+    if (Line == "end") {
+      break;
+    }
+    auto [Kind, Args] = Line.split(' ');
+    auto [Name, Value] = Args.rsplit(' ');
+    if (Kind == "import") {
+      importOnce(Args.str());
+    } else if (Kind == "sig") {
+      unsigned Arity;
+      if (Value.getAsInteger(10, Arity)) {
+        break;
+      }
+      FunctionSignatures.set(Name, {Arity, CallingConv::C});
+    } else if (Kind == "const") {
+      uint64_t Bits;
+      if (Value.getAsInteger(16, Bits)) {
+        break;
+      }
+      if (!FrozenNames.count(Name.str())) {
+        setConstant(Name.str(), BitsToDouble(Bits));
+      }
+    } else if (Kind == "alias") {
+      Aliases[Name.str()] = Value.str();
+    } else if (Kind == "use") {
+      ConstantUsers[Name.str()].insert(Value.str());
+    } else if (Kind == "object") {
+      size_t Size;
+      if (Value.getAsInteger(10, Size)) {
+        break;
+      }
+      Sizes.emplace_back(Name.str(), Size);
+    } else {
+      break;
+    }
+  }
+  if (Line != "end") {
+    fprintf(stderr, "%s is corrupt: \"%s\"\n", Path.c_str(), Line.str().c_str());
+    return false;
+  }
+
+  std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+  size_t Offset = Rest.data() - (*Buffer)->getBufferStart();
+  for (auto &[Name, Size]: Sizes) {
+    Offset = alignTo(Offset, 16);
+    if (Offset + Size > (*Buffer)->getBufferSize()) {
+      fprintf(stderr, "%s is truncated\n", Path.c_str());
+      return false;
+    }
+    StringRef Obj = (*Buffer)->getBuffer().substr(Offset, Size);
+    RestoredObjects[Name] = Obj;
+    Objects.push_back(MemoryBuffer::getMemBuffer(Obj, Name, false));
+    Offset += Size;
+  }
+  LoadedArtifacts.push_back(std::move(*Buffer));
+  ExitOnErr(TheJIT->addLibrary(Path, std::move(Objects), Aliases));
+  for (auto &[Name, Target]: Aliases) {
+    AliasesOf[Target].push_back(Name);
+  }
+  return true;
+}
+
+// HandleSnapshot - snapshot "file"
+static void HandleSnapshot() {
+  getNextToken(); // eat snapshot
+  if (CurTok != tok_string) {
+    LogError("Expected a file name in quotes after snapshot");
+    return;
+  }
+  if (TheTargetMachine) {
+    fprintf(stderr, "Snapshots are only taken of JIT sessions\n");
+  } else {
+    writeSnapshot(StringVal);
+  }
+  getNextToken();
+}
+
+/**
+ * Ahead-of-time compilation
+ * https://llvm.org/docs/tutorial/MyFirstLanguageFrontend/LangImpl08.html
+ */
+
+// orderFunctionsByCallGraph - lay out the module so that each caller is
+// followed by the callees it reaches directly, the most frequently called
+// first. Without a runtime profile, call frequency is estimated statically
+// from the block frequencies of the call sites.
+static void orderFunctionsByCallGraph(Module &M, FunctionAnalysisManager &FAM) {
+  std::map<Function *, std::vector<std::pair<double, Function *>>> Callees;
+  std::set<Function *> Called;
+  for (auto &F: M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+    std::map<Function *, double> Weights;
+    for (auto &BB: F) {
+      for (auto &I: BB) {
+        auto *CI = dyn_cast<CallInst>(&I);
+        Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+        if (Callee && !Callee->isDeclaration() && Callee != &F) {
+          Weights[Callee] += BFI.getBlockFreqRelativeToEntryBlock(&BB);
+          Called.insert(Callee);
+        }
+      }
+    }
+    for (auto &[Callee, Weight]: Weights) {
+      Callees[&F].emplace_back(Weight, Callee);
+    }
+    std::sort(Callees[&F].begin(), Callees[&F].end(),
+              [](const auto &L, const auto &R) { return L.first > R.first; });
+  }
+
+  std::vector<Function *> Order;
+  std::set<Function *> Placed;
+  std::function<void(Function *)> Place = [&](Function *F) {
+    if (!Placed.insert(F).second) {
+      return;
+    }
+    Order.push_back(F);
+    for (auto &[Weight, Callee]: Callees[F]) {
+      Place(Callee);
+    }
+  };
+  // start from the entry points (functions nobody calls), then pick up the rest
+  for (auto &F: M) {
+    if (!F.isDeclaration() && !Called.count(&F)) {
+      Place(&F);
+    }
+  }
+  for (auto &F: M) {
+    if (!F.isDeclaration()) {
+      Place(&F);
+    }
+  }
+  for (Function *F: Order) {
+    F->removeFromParent();
+    M.getFunctionList().push_back(F);
+  }
+}
+
+// CPUVariant - a feature level a multiversioned function is also compiled for,
+// and the bits of compiler-rt/libgcc's __cpu_model features (0-31) and
+// __cpu_features2 (32-63) that select it. A variant needs every feature its
+// level lets the backend use, not just the ones it is named after; a runtime
+// that does not report one of them only ever picks a lower variant.
+struct CPUVariant {
+  const char *Suffix;
+  const char *CPU;
+  std::vector<X86::ProcessorFeatures> Required;
+};
+
+// best first
+static const CPUVariant X86Variants[] = {
+        {"avx512", "x86-64-v4", {X86::FEATURE_AVX, X86::FEATURE_AVX2, X86::FEATURE_BMI, X86::FEATURE_BMI2,
+                                 X86::FEATURE_F16C, X86::FEATURE_FMA, X86::FEATURE_LZCNT, X86::FEATURE_MOVBE,
+                                 X86::FEATURE_AVX512F, X86::FEATURE_AVX512VL, X86::FEATURE_AVX512BW,
+                                 X86::FEATURE_AVX512DQ, X86::FEATURE_AVX512CD}},
+        {"avx2", "x86-64-v3", {X86::FEATURE_AVX, X86::FEATURE_AVX2, X86::FEATURE_BMI, X86::FEATURE_BMI2,
+                               X86::FEATURE_F16C, X86::FEATURE_FMA, X86::FEATURE_LZCNT, X86::FEATURE_MOVBE}},
+};
+
+// multiversionFunctions - replace each named function by a dispatcher that
+// calls through a pointer to one of its variants. A module constructor picks
+// the best variant the host supports when the object is loaded, the same way
+// clang's target_clones resolvers do, but without needing ifunc support.
+static void multiversionFunctions(Module &M, FunctionAnalysisManager &FAM) {
+  if (MultiversionFunctions.empty()) {
+    return;
+  }
+  if (TheTargetMachine->getTargetTriple().getArch() != Triple::x86_64) {
+    fprintf(stderr, "Multiversioning is only available for x86-64 targets, ignoring -multiversion\n");
+    return;
+  }
+
+  auto &Ctx = M.getContext();
+  auto *Int32Ty = Type::getInt32Ty(Ctx);
+  auto *PtrTy = PointerType::getUnqual(Ctx);
+  // struct __processor_model { unsigned vendor, type, subtype; unsigned features[1]; }
+  auto *CPUModelTy = StructType::get(Int32Ty, Int32Ty, Int32Ty, ArrayType::get(Int32Ty, 1));
+  auto *CPUModel = M.getOrInsertGlobal("__cpu_model", CPUModelTy);
+  auto CPUInit = M.getOrInsertFunction("__cpu_indicator_init", Type::getVoidTy(Ctx));
+
+  Function *Resolver = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                        Function::InternalLinkage, "ks.multiversion.resolver", M);
+  IRBuilder<> RB(BasicBlock::Create(Ctx, "entry", Resolver));
+  RB.CreateCall(CPUInit);
+  Value *Features = RB.CreateLoad(Int32Ty, RB.CreateConstInBoundsGEP2_32(CPUModelTy, CPUModel, 0, 3));
+  // an array in newer runtimes, whose first word holds features 32-63 either way
+  Value *Features2 = RB.CreateLoad(Int32Ty, M.getOrInsertGlobal("__cpu_features2", Int32Ty));
+
+  // the variants are vectorized for their own feature level
+  FunctionPassManager VectorizeFPM;
+  VectorizeFPM.addPass(LoopVectorizePass());
+  VectorizeFPM.addPass(SLPVectorizerPass());
+
+  for (auto &Name: MultiversionFunctions) {
+    Function *F = M.getFunction(Name);
+    if (!F || F->isDeclaration()) {
+      fprintf(stderr, "Cannot multiversion unknown function %s\n", Name.c_str());
+      continue;
+    }
+
+    ValueToValueMapTy DefaultMap;
+    Function *Default = CloneFunction(F, DefaultMap);
+    Default->setName(Name + ".default");
+    Default->setLinkage(Function::InternalLinkage);
+    VectorizeFPM.run(*Default, FAM);
+
+    Value *Chosen = Default;
+    for (auto I = std::rbegin(X86Variants), E = std::rend(X86Variants); I != E; ++I) {
+      ValueToValueMapTy VMap;
+      Function *V = CloneFunction(F, VMap);
+      V->setName(Name + "." + I->Suffix);
+      V->setLinkage(Function::InternalLinkage);
+      V->addFnAttr("target-cpu", I->CPU);
+      VectorizeFPM.run(*V, FAM);
+
+      uint32_t Mask = 0, Mask2 = 0;
+      for (auto Feature: I->Required) {
+        assert(Feature < 64 && "feature not reported by __cpu_model");
+        (Feature < 32 ? Mask : Mask2) |= 1u << (Feature % 32);
+      }
+      Value *Supported = RB.CreateAnd(RB.CreateICmpEQ(RB.CreateAnd(Features, Mask), RB.getInt32(Mask)),
+                                      RB.CreateICmpEQ(RB.CreateAnd(Features2, Mask2), RB.getInt32(Mask2)));
+      Chosen = RB.CreateSelect(Supported, V, Chosen);
+    }
+
+    // until the resolver runs, calls go to the baseline variant
+    auto *Target = new GlobalVariable(M, PtrTy, false, GlobalValue::InternalLinkage, Default,
+                                      Name + ".target");
+    RB.CreateStore(Chosen, Target);
+
+    F->deleteBody();
+    IRBuilder<> DB(BasicBlock::Create(Ctx, "entry", F));
+    std::vector<Value *> Args;
+    for (auto &Arg: F->args()) {
+      Args.push_back(&Arg);
+    }
+    CallInst *Call = DB.CreateCall(F->getFunctionType(), DB.CreateLoad(PtrTy, Target), Args);
+    Call->setTailCall();
+    DB.CreateRet(Call);
+  }
+  RB.CreateRetVoid();
+  appendToGlobalCtors(M, Resolver, 0);
+}
+
+static std::unique_ptr<TargetMachine> newTargetMachine(std::string &Error) {
+  auto TargetTriple = sys::getDefaultTargetTriple();
+  auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+  if (!Target) {
+    return nullptr;
+  }
+  TargetOptions Opt;
+  return std::unique_ptr<TargetMachine>(
+          Target->createTargetMachine(TargetTriple, "generic", "", Opt, Reloc::PIC_));
+}
+
+static bool CreateTargetMachine() {
+  std::string Error;
+  TheTargetMachine = newTargetMachine(Error);
+  if (!TheTargetMachine) {
+    errs() << Error;
+    return false;
+  }
+  return true;
+}
+
+static bool emitObject(Module &M, TargetMachine &TM, const std::string &Filename, std::string &Error) {
+  std::error_code EC;
+  raw_fd_ostream Dest(Filename, EC, sys::fs::OF_None);
+  if (EC) {
+    Error = "Could not open file: " + EC.message();
+    return false;
+  }
+  legacy::PassManager Pass;
+  if (TM.addPassesToEmitFile(Pass, Dest, nullptr, CodeGenFileType::ObjectFile)) {
+    Error = "TheTargetMachine can't emit a file of this type";
+    return false;
+  }
+  Pass.run(M);
+  Dest.flush();
+  return true;
+}
+
+// splitModule - partition the defined functions, in module order (which is
+// call-graph order by now), into N contiguous runs of about the same number
+// of instructions, so callers mostly stay with their callees. Every part
+// declares what it uses from the others; globals and constructors go to part
+// 0. Internal symbols are made hidden so they can be referenced across parts.
+static std::vector<std::unique_ptr<Module>> splitModule(Module &M, unsigned N) {
+  uint64_t Total = 0;
+  for (auto &F: M) {
+    Total += F.getInstructionCount();
+  }
+  for (auto &GV: M.global_values()) {
+    if (GV.hasLocalLinkage() && !GV.getName().starts_with("llvm.")) {
+      if (!GV.hasName()) {
+        GV.setName("ks.local");
+      }
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setVisibility(GlobalValue::HiddenVisibility);
+    }
+  }
+
+  std::map<const GlobalValue *, unsigned> Part;
+  unsigned Current = 0;
+  uint64_t Size = 0;
+  for (auto &F: M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    if (Size >= (Total + N - 1) / N && Current + 1 < N) {
+      ++Current;
+      Size = 0;
+    }
+    Part[&F] = Current;
+    Size += F.getInstructionCount();
+  }
+
+  std::vector<std::unique_ptr<Module>> Parts;
+  for (unsigned I = 0; I <= Current; ++I) {
+    ValueToValueMapTy VMap;
+    auto P = CloneModule(M, VMap, [&](const GlobalValue *GV) {
+      auto It = Part.find(GV);
+      return It == Part.end() ? I == 0 : It->second == I;
+    });
+    if (auto *Ctors = P->getNamedGlobal("llvm.global_ctors"); Ctors && Ctors->isDeclaration()) {
+      Ctors->eraseFromParent();
+    }
+    Parts.push_back(std::move(P));
+  }
+  return Parts;
+}
+
+static std::string getPartFilename(StringRef Filename, unsigned I) {
+  SmallString<128> Path(Filename);
+  std::string Ext = sys::path::extension(Filename).str();
+  sys::path::replace_extension(Path, "." + std::to_string(I) + Ext);
+  return Path.str().str();
+}
+
+// emitObjectFilesInParallel - one object file per part of the module, each
+// generated on its own thread. LLVMContexts are not thread-safe, so every
+// part travels to its thread as bitcode and is compiled in a fresh context.
+static bool emitObjectFilesInParallel(Module &M, unsigned N) {
+  auto Parts = splitModule(M, N);
+  std::vector<SmallString<0>> Bitcode(Parts.size());
+  for (unsigned I = 0; I < Parts.size(); ++I) {
+    raw_svector_ostream OS(Bitcode[I]);
+    WriteBitcodeToFile(*Parts[I], OS);
+  }
+  Parts.clear();
+
+  std::vector<std::string> Errors(Bitcode.size());
+  std::vector<std::thread> Threads;
+  for (unsigned I = 0; I < Bitcode.size(); ++I) {
+    Threads.emplace_back([&, I]() {
+      LLVMContext Ctx;
+      auto Part = parseBitcodeFile(MemoryBufferRef(Bitcode[I].str(), "part"), Ctx);
+      if (!Part) {
+        Errors[I] = toString(Part.takeError());
+        return;
+      }
+      auto TM = newTargetMachine(Errors[I]);
+      if (TM) {
+        emitObject(**Part, *TM, getPartFilename(ObjectFilename, I), Errors[I]);
+      }
+    });
+  }
+  for (auto &T: Threads) {
+    T.join();
+  }
+
+  bool OK = true;
+  for (unsigned I = 0; I < Errors.size(); ++I) {
+    if (!Errors[I].empty()) {
+      errs() << Errors[I] << "\n";
+      OK = false;
+    } else {
+      fprintf(stderr, "Wrote %s\n", getPartFilename(ObjectFilename, I).c_str());
+    }
+  }
+  return OK;
+}
+
+// addStaticProfile - ahead of time there are no counts to split hot from
+// cold code by, but likely(), unlikely() and the safepoint polls give branch
+// probabilities. Every function gets the same entry count, and a summary in
+// which a block is cold below 1% of its function's entry and nothing is hot,
+// so HotColdSplitting outlines the arms marked unlikely and nothing else is
+// treated differently.
+static void addStaticProfile(Module &M) {
+  bool HasWeights = false;
+  for (auto &F: M) {
+    for (auto &BB: F) {
+      HasWeights |= BB.getTerminator() && BB.getTerminator()->getMetadata(LLVMContext::MD_prof);
+    }
+  }
+  if (!HasWeights) {
+    return;
+  }
+  const uint64_t EntryCount = 1 << 20;
+  uint64_t NumFunctions = 0;
+  for (auto &F: M) {
+    if (!F.isDeclaration()) {
+      F.setEntryCount(EntryCount);
+      ++NumFunctions;
+    }
+  }
+  SummaryEntryVector Detailed;
+  for (uint32_t Cutoff: ProfileSummaryBuilder::DefaultCutoffs) {
+    Detailed.emplace_back(Cutoff, Cutoff < 999999 ? std::numeric_limits<uint64_t>::max() : EntryCount / 100,
+                          NumFunctions);
+  }
+  ProfileSummary Summary(ProfileSummary::PSK_Instr, Detailed, EntryCount * NumFunctions, EntryCount, EntryCount,
+                         EntryCount, NumFunctions, NumFunctions);
+  M.setProfileSummary(Summary.getMD(M.getContext()), ProfileSummary::PSK_Instr);
+}
+
+static bool EmitObjectFile() {
+  // Multiversioning, merging of identical functions, call-graph ordering,
+  // then hot/cold splitting on the static profile: the outlined cold parts
+  // are appended to the end of the module, away from the hot code
+  {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TheTargetMachine.get());
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    multiversionFunctions(*TheModule, FAM);
+    FAM.clear();
+    {
+      // the whole program is known, so identical functions can be folded
+      ModulePassManager MPM;
+      MPM.addPass(MergeFunctionsPass());
+      MPM.run(*TheModule, MAM);
+    }
+    FAM.clear();
+    orderFunctionsByCallGraph(*TheModule, FAM);
+    FAM.clear();
+    addStaticProfile(*TheModule);
+    ModulePassManager MPM;
+    MPM.addPass(HotColdSplittingPass());
+    MPM.run(*TheModule, MAM);
+  }
+
+  if (CodeGenThreads > 1) {
+    return emitObjectFilesInParallel(*TheModule, CodeGenThreads);
+  }
+  std::string Error;
+  if (!emitObject(*TheModule, *TheTargetMachine, ObjectFilename, Error)) {
+    errs() << Error << "\n";
+    return false;
+  }
+  fprintf(stderr, "Wrote %s\n", ObjectFilename.c_str());
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+  fputc((char) X, stderr);
+  return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+/**
+ * Safepoints
+ *
+ * Code compiled with -safepoints reads __ks_poll at function entry and at loop
+ * back-edges. The word counts the evaluations with a pending request, so it is
+ * zero almost always; when it is not, __ks_safepoint looks at the request of
+ * the evaluation running on the calling thread. A cancelled evaluation is
+ * unwound with siglongjmp, which is safe because JIT'd frames own no resources.
+ */
+enum SafepointRequest : uint32_t {
+  SafepointNone = 0,
+  SafepointYield = 1, // give up the CPU, then carry on
+  SafepointCancel = 2 // unwind the evaluation
+};
+
+struct EvaluationContext {
+  std::atomic<uint32_t> Request{SafepointNone};
+  sigjmp_buf Env;
+};
+
+extern "C" {
+DLLEXPORT std::atomic<uint32_t> __ks_poll{0};
+}
+
+static thread_local EvaluationContext *CurrentEvaluation = nullptr;
+// the evaluation on the driver thread, for the SIGINT handler
+static std::atomic<EvaluationContext *> InterruptibleEvaluation{nullptr};
+
+// requestSafepoint - may be called from any thread and from signal handlers
+static void requestSafepoint(EvaluationContext &Ctx, SafepointRequest Request) {
+  if (Ctx.Request.exchange(Request) == SafepointNone) {
+    __ks_poll.fetch_add(1);
+  }
+}
+
+static SafepointRequest takeSafepointRequest(EvaluationContext &Ctx) {
+  auto Request = static_cast<SafepointRequest>(Ctx.Request.exchange(SafepointNone));
+  if (Request != SafepointNone) {
+    __ks_poll.fetch_sub(1);
+  }
+  return Request;
+}
+
+extern "C" DLLEXPORT void __ks_safepoint() {
+  EvaluationContext *Ctx = CurrentEvaluation;
+  if (!Ctx) {
+    return;
+  }
+  switch (takeSafepointRequest(*Ctx)) {
+    case SafepointYield:
+      std::this_thread::yield();
+      break;
+    case SafepointCancel:
+      siglongjmp(Ctx->Env, 1);
+    default:
+      break;
+  }
+}
+
+// __ks_stale_call - the body of a definition that calls another one with the
+// wrong number of arguments since that one was redefined
+extern "C" DLLEXPORT double __ks_stale_call(const char *Name) {
+  fprintf(stderr, "Error: %s must be redefined, a function it calls changed its number of arguments\n", Name);
+  if (EvaluationContext *Ctx = CurrentEvaluation) {
+    siglongjmp(Ctx->Env, 1);
+  }
+  return std::numeric_limits<double>::quiet_NaN();
+}
+
+static void handleInterrupt(int) {
+  if (EvaluationContext *Ctx = InterruptibleEvaluation.load()) {
+    requestSafepoint(*Ctx, SafepointCancel);
+    return;
+  }
+  if (IsWorker || PendingWorkers.load()) {
+    // the workers got it too: a worker past its evaluation is about to
+    // report, and the session waits for them
+    return;
+  }
+  // nothing to cancel, Ctrl-C ends the session as usual
+  signal(SIGINT, SIG_DFL);
+  raise(SIGINT);
+}
+
+/**
+ * Evaluation budgets and accounting
+ *
+ * Each evaluation is metered on its own thread: CPU time from the thread's CPU
+ * clock and, on Linux, retired user-space instructions from a perf_event
+ * counter. With a budget, a watchdog thread samples both every millisecond and
+ * cancels the evaluation at its next safepoint once either is exceeded. Time
+ * spent compiling lazily called functions on the evaluating thread counts too.
+ */
+
+// ThreadCpuClock - the CPU time of the thread that created it, readable from any thread
+class ThreadCpuClock {
+#ifdef __APPLE__
+  mach_port_t Thread = pthread_mach_thread_np(pthread_self());
+#else
+  clockid_t Clock;
+  bool Valid = pthread_getcpuclockid(pthread_self(), &Clock) == 0;
+#endif
+
+public:
+  double millis() const {
+#ifdef __APPLE__
+    thread_basic_info_data_t Info;
+    mach_msg_type_number_t Count = THREAD_BASIC_INFO_COUNT;
+    if (thread_info(Thread, THREAD_BASIC_INFO, (thread_info_t) &Info, &Count) != KERN_SUCCESS) {
+      return 0;
+    }
+    return (Info.user_time.seconds + Info.system_time.seconds) * 1e3 +
+           (Info.user_time.microseconds + Info.system_time.microseconds) / 1e3;
+#else
+    timespec T;
+    if (!Valid || clock_gettime(Clock, &T)) {
+      return 0;
+    }
+    return T.tv_sec * 1e3 + T.tv_nsec / 1e6;
+#endif
+  }
+};
+
+// InstructionCounter - user-space instructions retired by the thread that
+// created it; unavailable off Linux or when perf_event_paranoid forbids it
+class InstructionCounter {
+  int Fd = -1;
+
+public:
+  InstructionCounter() {
+#ifdef __linux__
+    perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.size = sizeof(Attr);
+    Attr.type = PERF_TYPE_HARDWARE;
+    Attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    Fd = static_cast<int>(syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0));
+#endif
+  }
+
+  InstructionCounter(const InstructionCounter &) = delete;
+  InstructionCounter &operator=(const InstructionCounter &) = delete;
+
+  ~InstructionCounter() {
+    if (Fd >= 0) {
+      close(Fd);
+    }
+  }
+
+  bool available() const { return Fd >= 0; }
+
+  uint64_t read() const {
+    uint64_t Count = 0;
+    if (Fd < 0 || ::read(Fd, &Count, sizeof(Count)) != sizeof(Count)) {
+      return 0;
+    }
+    return Count;
+  }
+};
+
+static FILE *AccountingFile = nullptr;
+static uint64_t EvaluationCount = 0;
+
+static bool openAccounting() {
+  if (AccountingFilename.empty()) {
+    return true;
+  }
+  AccountingFile = fopen(AccountingFilename.c_str(), "a");
+  if (!AccountingFile) {
+    fprintf(stderr, "Could not open %s\n", AccountingFilename.c_str());
+    return false;
+  }
+  if (ftell(AccountingFile) == 0) {
+    fprintf(AccountingFile, "pid,evaluation,outcome,cpu_ms,wall_ms,instructions\n");
+  }
+  return true;
+}
+
+static const char *getOutcomeName(EvaluationOutcome Outcome) {
+  static const char *OutcomeNames[] = {"finished", "cancelled", "over-budget"};
+  return OutcomeNames[static_cast<int>(Outcome)];
+}
+
+// recordEvaluation - Pid is the process that ran the evaluation; the rows are
+// always written and numbered by the session
+static void recordEvaluation(pid_t Pid, const char *Outcome, const EvaluationUsage &Usage) {
+  ++EvaluationCount;
+  if (!AccountingFile) {
+    return;
+  }
+  fprintf(AccountingFile, "%d,%llu,%s,%.3f,%.3f,", (int) Pid, (unsigned long long) EvaluationCount,
+          Outcome, Usage.CpuMs, Usage.WallMs);
+  if (Usage.Counted) {
+    fprintf(AccountingFile, "%llu", (unsigned long long) Usage.Instructions);
+  }
+  fprintf(AccountingFile, "\n");
+  fflush(AccountingFile);
+}
+
+// runEvaluation - call FP on this thread, within the budgets
+static EvaluationOutcome runEvaluation(double (*FP)(), double &Result, EvaluationUsage *Usage) {
+  EvaluationContext Ctx;
+  ThreadCpuClock Clock;
+  std::optional<InstructionCounter> Counter;
+  if (InstructionBudget || AccountingFile) {
+    Counter.emplace();
+    if (InstructionBudget && !Counter->available()) {
+      static bool Warned = false;
+      if (!Warned) {
+        fprintf(stderr, "Instructions cannot be counted here, -instruction-budget is ignored\n");
+        Warned = true;
+      }
+    }
+  }
+  auto WallStart = std::chrono::steady_clock::now();
+  double CpuStart = Clock.millis();
+
+  std::mutex WatchdogMutex;
+  std::condition_variable WatchdogCV;
+  bool Done = false;
+  std::atomic<bool> OverBudget{false};
+  std::thread Watchdog;
+  if (CpuBudgetMs || (InstructionBudget && Counter->available())) {
+    Watchdog = std::thread([&]() {
+      std::unique_lock<std::mutex> Lock(WatchdogMutex);
+      while (!WatchdogCV.wait_for(Lock, std::chrono::milliseconds(1), [&]() { return Done; })) {
+        if ((CpuBudgetMs && Clock.millis() - CpuStart >= CpuBudgetMs) ||
+            (InstructionBudget && Counter->available() && Counter->read() >= InstructionBudget)) {
+          OverBudget = true;
+          requestSafepoint(Ctx, SafepointCancel);
+          return;
+        }
+      }
+    });
+  }
+
+  CurrentEvaluation = &Ctx;
+  InterruptibleEvaluation = &Ctx;
+  EvaluationOutcome Outcome = EvaluationOutcome::Cancelled;
+  if (!sigsetjmp(Ctx.Env, 0)) {
+    Result = FP();
+    Outcome = EvaluationOutcome::Finished;
+  }
+  InterruptibleEvaluation = nullptr;
+  CurrentEvaluation = nullptr;
+
+  if (Watchdog.joinable()) {
+    {
+      std::lock_guard<std::mutex> Lock(WatchdogMutex);
+      Done = true;
+    }
+    WatchdogCV.notify_one();
+    Watchdog.join();
+  }
+  // a request that came after the last poll must not keep the others polling
+  takeSafepointRequest(Ctx);
+  if (Outcome == EvaluationOutcome::Cancelled && OverBudget) {
+    Outcome = EvaluationOutcome::OverBudget;
+  }
+
+  EvaluationUsage Measured;
+  Measured.CpuMs = Clock.millis() - CpuStart;
+  Measured.WallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - WallStart).count();
+  if (Counter && Counter->available()) {
+    Measured.Counted = true;
+    Measured.Instructions = Counter->read();
+  }
+  if (Usage) {
+    *Usage = Measured;
+  } else {
+    recordEvaluation(getpid(), getOutcomeName(Outcome), Measured);
+  }
+  return Outcome;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
 
-int main() {
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
@@ -1082,15 +4301,86 @@ int main() {
   BinopPrecedence['-'] = 20;
   BinopPrecedence['*'] = 40;  // highest.
   // ...
-  fprintf(stderr, "ready> ");
-  getNextToken();
+  if (!WatchFilename.empty()) {
+    if (!ObjectFilename.empty()) {
+      fprintf(stderr, "-watch cannot be combined with -emit-obj\n");
+      return 1;
+    }
+  } else {
+    fprintf(stderr, "ready> ");
+    getNextToken();
+  }
+
+  for (auto &Option: FrozenOptions) {
+    std::string Name;
+    double Value;
+    if (!parseFrozenValue(Option, Name, Value)) {
+      fprintf(stderr, "-frozen expects name=value, not %s\n", Option.c_str());
+      return 1;
+    }
+    setFrozenValue(Name, Value);
+  }
+  reloadFrozenValues();
 
   // Make the module, which holds all the code
+  if (!ObjectFilename.empty()) {
+    if (!CreateTargetMachine()) {
+      return 1;
+    }
+    InitializeModuleAndPassManagers();
+    MainLoop();
+    return EmitObjectFile() ? 0 : 1;
+  }
+
+  if (CpuBudgetMs || InstructionBudget) {
+    // budgets are enforced at safepoints
+    Safepoints = true;
+  }
+  if (Safepoints) {
+    signal(SIGINT, handleInterrupt);
+  }
+  if (!openAccounting()) {
+    return 1;
+  }
 
-  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+  TheJIT = ExitOnErr(KaleidoscopeJIT::Create(CodeGenThreads));
+  TheJIT->setCodeBudget(CodeBudget);
+  TheJIT->setRetainIR(!StreamMode);
+  TheJIT->setHugePageMode(HugePages);
+  TheJIT->setProfileBranches(HotCallThreshold != 0);
+  TheJIT->setFastCodeGen(FastCodeGen, HotCallThreshold != 0);
+  TheJIT->setCodeGenStats(CodeGenStats);
+  TheJIT->setSpeculationThreads(SpeculationThreads);
+  TheJIT->setHotOptimizer(optimizeAggressively);
 
   InitializeModuleAndPassManagers();
 
+  if (!PreludeFilename.empty()) {
+    SmallString<128> Path;
+    if (sys::fs::real_path(PreludeFilename, Path)) {
+      fprintf(stderr, "Could not find %s\n", PreludeFilename.c_str());
+      return 1;
+    }
+    importOnce(Path.str().str(), true);
+  }
+
+  if (SignatureBenchmark) {
+    runSignatureBenchmark(SignatureBenchmark);
+    return 0;
+  }
+
+  if (TenantBenchmark) {
+    return runTenantBenchmark(TenantBenchmark) ? 0 : 1;
+  }
+
+  if (!RestoreFilename.empty() && !restoreSnapshot(RestoreFilename)) {
+    return 1;
+  }
+
+  if (!WatchFilename.empty()) {
+    return WatchLoop() ? 0 : 1;
+  }
+
   // Run the main "interpreter loop" now
   MainLoop();
 